@@ -0,0 +1,15 @@
+--
+-- Copyright (C) 2017 iCub Facility
+-- CopyPolicy: Released under the terms of the LGPLv2.1 or later, see LGPL.TXT
+--
+-- A minimal ping-pong state machine used by rfsmBenchmark
+
+return rfsm.state {
+    PING = rfsm.state { },
+
+    PONG = rfsm.state { },
+
+    rfsm.transition { src='initial', tgt='PING' },
+    rfsm.transition { src='PING', tgt='PONG', events={ 'e_ping' } },
+    rfsm.transition { src='PONG', tgt='PING', events={ 'e_pong' } },
+}
@@ -0,0 +1,540 @@
+// -*- mode:C++; tab-width:4; c-basic-offset:4; indent-tabs-mode:nil -*-
+
+/*
+ * Copyright (C) 2017 iCub Facility
+ * Authors: Ali Paikan <ali.paikan@iit.it>, Nicolo' Genesio <nicolo.genesio@iit.it>
+ * CopyPolicy: Released under the terms of the LGPLv2.1 or later, see LGPL.TXT
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <rfsm.h>
+#include <rfsmExecutor.h>
+
+using namespace std;
+
+#ifndef RFSM_LUA_ENGINE
+    #define RFSM_LUA_ENGINE "unknown"
+#endif
+
+// number of events sent before draining the queue with a step
+static const unsigned int BATCH = 100;
+
+class Stopwatch {
+public:
+    void start() { t0 = std::chrono::steady_clock::now(); }
+    void stop() { elapsed += std::chrono::steady_clock::now() - t0; }
+    double nsPerOp(unsigned int ops) const {
+        return std::chrono::duration<double, std::nano>(elapsed).count() / ops;
+    }
+private:
+    std::chrono::steady_clock::time_point t0;
+    std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::duration::zero();
+};
+
+static void report(const string& name, double nsPerOp) {
+    cout<<"  "<<left<<setw(44)<<name<<right<<setw(12)<<fixed<<setprecision(1)<<nsPerOp<<" ns/op"<<endl;
+}
+
+static void reportBytes(const string& name, size_t bytes) {
+    cout<<"  "<<left<<setw(44)<<name<<right<<setw(12)<<bytes<<" bytes"<<endl;
+}
+
+static const char* pingPong(unsigned int i) {
+    return (i % 2) ? "e_pong" : "e_ping";
+}
+
+
+/**
+ * load() of the state machine: the lua state is created and the rfsm
+ * engine and the model are compiled each time, unless the model is
+ * loaded from the cache (the first load fills the cache)
+ */
+static void benchLoad(const string& filename, unsigned int count,
+                      const string& cache="", bool trusted=false) {
+    Stopwatch watch;
+    for(unsigned int i=0; i<count; i++) {
+        rfsm::StateMachine fsm;
+        fsm.setModelCache(cache, trusted);
+        if(i == 0 && cache.size() && !fsm.load(filename))
+            return;
+        watch.start();
+        bool loaded = fsm.load(filename);
+        watch.stop();
+        if(!loaded)
+            return;
+    }
+    if(cache.empty())
+        report("load", watch.nsPerOp(count));
+    else
+        report(trusted ? "load (trusted model cache)" : "load (model cache)", watch.nsPerOp(count));
+}
+
+/**
+ * sendEvent() compiling a Lua chunk per call (the former implementation)
+ * against sendEvent() through the cached rfsm.send_events reference.
+ */
+static void benchSendEvent(rfsm::StateMachine& fsm, unsigned int iterations) {
+    Stopwatch chunk, cached;
+    for(unsigned int i=0; i<iterations; i++) {
+        chunk.start();
+        fsm.doString(string("rfsm.send_events(fsm, '") + pingPong(i) + "')");
+        chunk.stop();
+        if((i+1) % BATCH == 0)
+            fsm.step();
+    }
+    fsm.run();
+    for(unsigned int i=0; i<iterations; i++) {
+        cached.start();
+        fsm.sendEvent(pingPong(i));
+        cached.stop();
+        if((i+1) % BATCH == 0)
+            fsm.step();
+    }
+    fsm.run();
+    report("sendEvent (compiled chunk)", chunk.nsPerOp(iterations));
+    report("sendEvent (cached reference)", cached.nsPerOp(iterations));
+}
+
+/**
+ * sendEvent() by name (validated through the event index) against
+ * sendEvent() by interned id
+ */
+static void benchSendEventId(rfsm::StateMachine& fsm, unsigned int iterations) {
+    Stopwatch byName, byId;
+    rfsm::EventId ids[2] = { fsm.eventId("e_ping"), fsm.eventId("e_pong") };
+    std::string names[2] = { "e_ping", "e_pong" };
+    for(unsigned int i=0; i<iterations; i++) {
+        byName.start();
+        fsm.sendEvent(names[i % 2]);
+        byName.stop();
+        if((i+1) % BATCH == 0)
+            fsm.step();
+    }
+    fsm.run();
+    for(unsigned int i=0; i<iterations; i++) {
+        byId.start();
+        fsm.sendEvent(ids[i % 2]);
+        byId.stop();
+        if((i+1) % BATCH == 0)
+            fsm.step();
+    }
+    fsm.run();
+    report("sendEvent (by name)", byName.nsPerOp(iterations));
+    report("sendEvent (by EventId)", byId.nsPerOp(iterations));
+}
+
+/**
+ * stepping an idle state machine: this is dominated by the cost
+ * of entering Lua
+ */
+static void benchStep(rfsm::StateMachine& fsm, unsigned int iterations) {
+    Stopwatch chunk, cached;
+    chunk.start();
+    for(unsigned int i=0; i<iterations; i++)
+        fsm.doString("rfsm.step(fsm, 1)");
+    chunk.stop();
+    cached.start();
+    for(unsigned int i=0; i<iterations; i++)
+        fsm.step();
+    cached.stop();
+    report("step (compiled chunk)", chunk.nsPerOp(iterations));
+    report("step (cached reference)", cached.nsPerOp(iterations));
+}
+
+/**
+ * one event and one step per iteration, each of them firing a transition
+ * (separate calls against the fused sendAndStep())
+ */
+static void benchSendAndStep(rfsm::StateMachine& fsm, unsigned int iterations) {
+    Stopwatch chunk, cached, fused;
+    chunk.start();
+    for(unsigned int i=0; i<iterations; i++) {
+        fsm.doString(string("rfsm.send_events(fsm, '") + pingPong(i) + "')");
+        fsm.doString("rfsm.step(fsm, 1)");
+    }
+    chunk.stop();
+    cached.start();
+    for(unsigned int i=0; i<iterations; i++) {
+        fsm.sendEvent(pingPong(i));
+        fsm.step();
+    }
+    cached.stop();
+    fused.start();
+    for(unsigned int i=0; i<iterations; i++)
+        fsm.sendAndStep(pingPong(i));
+    fused.stop();
+    report("sendEvent + step (compiled chunk)", chunk.nsPerOp(iterations));
+    report("sendEvent + step (cached reference)", cached.nsPerOp(iterations));
+    report("sendAndStep", fused.nsPerOp(iterations));
+}
+
+
+/**
+ * bursts of BATCH events sent one by one against a single sendEvents() call
+ */
+static void benchSendEvents(rfsm::StateMachine& fsm, unsigned int iterations) {
+    Stopwatch single, batch;
+    std::vector<std::string> events;
+    for(unsigned int i=0; i<BATCH; i++)
+        events.push_back(pingPong(i));
+    unsigned int bursts = iterations / BATCH;
+    for(unsigned int b=0; b<bursts; b++) {
+        single.start();
+        for(unsigned int i=0; i<BATCH; i++)
+            fsm.sendEvent(events[i]);
+        single.stop();
+        fsm.step();
+    }
+    for(unsigned int b=0; b<bursts; b++) {
+        batch.start();
+        fsm.sendEvents(events);
+        batch.stop();
+        fsm.step();
+    }
+    fsm.run();
+    report("sendEvent x100 (per event)", single.nsPerOp(bursts * BATCH));
+    report("sendEvents(vector) x100 (per event)", batch.nsPerOp(bursts * BATCH));
+}
+
+/**
+ * sendEvent() against postEvent(), which only pushes into the lock-free
+ * queue and leaves the merge to the next step
+ */
+static void benchPostEvent(rfsm::StateMachine& fsm, unsigned int iterations) {
+    Stopwatch send, post;
+    rfsm::EventId ids[2] = { fsm.eventId("e_ping"), fsm.eventId("e_pong") };
+    for(unsigned int i=0; i<iterations; i++) {
+        send.start();
+        fsm.sendEvent(ids[i % 2]);
+        send.stop();
+        if((i+1) % BATCH == 0)
+            fsm.step();
+    }
+    fsm.run();
+    for(unsigned int i=0; i<iterations; i++) {
+        post.start();
+        fsm.postEvent(ids[i % 2]);
+        post.stop();
+        if((i+1) % BATCH == 0)
+            fsm.step();
+    }
+    fsm.run();
+    report("sendEvent (by EventId)", send.nsPerOp(iterations));
+    report("postEvent (by EventId)", post.nsPerOp(iterations));
+}
+
+/**
+ * creating state machines with load() against instantiating
+ * them from a StateMachineTemplate loaded once
+ */
+static void benchInstantiate(const string& filename, unsigned int count) {
+    Stopwatch load, instantiate;
+    std::vector<rfsm::StateMachine*> machines;
+    for(unsigned int i=0; i<count; i++) {
+        rfsm::StateMachine* fsm = new rfsm::StateMachine();
+        load.start();
+        fsm->load(filename);
+        load.stop();
+        machines.push_back(fsm);
+    }
+    for(size_t i=0; i<machines.size(); i++)
+        delete machines[i];
+    machines.clear();
+
+    rfsm::StateMachineTemplate model;
+    if(!model.load(filename))
+        return;
+    for(unsigned int i=0; i<count; i++) {
+        rfsm::StateMachine* fsm = new rfsm::StateMachine();
+        instantiate.start();
+        model.instantiate(*fsm);
+        instantiate.stop();
+        machines.push_back(fsm);
+    }
+    for(size_t i=0; i<machines.size(); i++)
+        delete machines[i];
+    report("load (per machine)", load.nsPerOp(count));
+    report("StateMachineTemplate::instantiate", instantiate.nsPerOp(count));
+}
+
+/**
+ * loading state machines into a StateMachineHost and stepping them in turn
+ */
+static void benchHost(const string& filename, unsigned int count) {
+    Stopwatch load, step;
+    rfsm::StateMachineHost host;
+    if(!host.open())
+        return;
+    size_t shared = host.getMemoryUsage();
+    std::vector<rfsm::StateMachine*> machines;
+    for(unsigned int i=0; i<count; i++) {
+        rfsm::StateMachine* fsm = new rfsm::StateMachine();
+        load.start();
+        host.load(*fsm, filename);
+        load.stop();
+        machines.push_back(fsm);
+    }
+    step.start();
+    host.step();
+    step.stop();
+    report("StateMachineHost::load (per machine)", load.nsPerOp(count));
+    report("StateMachineHost::step (per machine)", step.nsPerOp(count));
+    reportBytes("StateMachineHost rfsm package", shared);
+    reportBytes("StateMachineHost footprint (per machine)", host.getFootprint(*machines[0]));
+    host.close();
+    for(size_t i=0; i<machines.size(); i++)
+        delete machines[i];
+}
+
+/**
+ * events posted to many state machines run by an Executor on all cores.
+ * Each round posts one event to every machine and waits for their
+ * transitions (rFSM consumes all the queued events in a single step)
+ */
+static void benchExecutor(const string& filename, unsigned int count, unsigned int iterations) {
+    Stopwatch run;
+    rfsm::Executor executor;
+    std::vector<rfsm::StateMachine*> machines;
+    for(unsigned int i=0; i<count; i++) {
+        rfsm::StateMachine* fsm = new rfsm::StateMachine();
+        if(fsm->load(filename))
+            executor.add(*fsm);
+        machines.push_back(fsm);
+    }
+    executor.start();
+    // waiting for the machines to enter their initial state
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    unsigned long long initial = executor.getStats().transitions;
+
+    unsigned int rounds = std::max(iterations / count, 1u);
+    unsigned long long posted = 0;
+    bool timedOut = false;
+    std::chrono::steady_clock::time_point timeout = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    run.start();
+    for(unsigned int r=0; r<rounds && !timedOut; r++) {
+        for(unsigned int i=0; i<count; i++)
+            posted += executor.postEvent(*machines[i], pingPong(r)) ? 1 : 0;
+        while(executor.getStats().transitions - initial < posted && !timedOut) {
+            std::this_thread::yield();
+            timedOut = (std::chrono::steady_clock::now() >= timeout);
+        }
+    }
+    run.stop();
+
+    rfsm::ExecutorStats stats = executor.getStats();
+    if(timedOut)
+        cout<<"  "<<left<<setw(44)<<"Executor (per transition)"<<right<<"timed out ("
+            <<stats.transitions - initial<<" of "<<posted<<" transitions)"<<endl;
+    else
+        report("Executor (per transition)", run.nsPerOp(posted));
+    cout<<"  "<<stats.tasks<<" tasks, "<<stats.steals<<" steals, "<<stats.wakeups<<" wakeups"<<endl;
+    for(size_t i=0; i<machines.size(); i++)
+        executor.remove(*machines[i]);
+    executor.stop();
+    for(size_t i=0; i<machines.size(); i++)
+        delete machines[i];
+}
+
+/**
+ * sendAndStep() on a state machine using the default allocator against
+ * one using a PoolAllocator
+ */
+static void benchAllocator(const string& filename, unsigned int iterations) {
+    Stopwatch system, pooled;
+    rfsm::PoolAllocator pool;
+    rfsm::StateMachine fsm, fsmPool;
+    fsmPool.setAllocator(&pool);
+    if(!fsm.load(filename) || !fsmPool.load(filename))
+        return;
+    fsm.run();
+    fsmPool.run();
+    system.start();
+    for(unsigned int i=0; i<iterations; i++)
+        fsm.sendAndStep(pingPong(i));
+    system.stop();
+    pooled.start();
+    for(unsigned int i=0; i<iterations; i++)
+        fsmPool.sendAndStep(pingPong(i));
+    pooled.stop();
+    report("sendAndStep (realloc)", system.nsPerOp(iterations));
+    report("sendAndStep (PoolAllocator)", pooled.nsPerOp(iterations));
+    reportBytes("peak memory (realloc)", fsm.getMemoryStats().peakBytes);
+    reportBytes("peak memory (PoolAllocator)", fsmPool.getMemoryStats().peakBytes);
+}
+
+// the p99.9 latency of sendAndStep() in ns
+static double sendAndStepLatency(rfsm::StateMachine& fsm, unsigned int iterations, bool collect) {
+    std::vector<double> samples;
+    samples.reserve(iterations);
+    for(unsigned int i=0; i<iterations; i++) {
+        std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+        fsm.sendAndStep(pingPong(i));
+        samples.push_back(std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count());
+        // idle time between the steps
+        if(collect)
+            fsm.collectGarbage(std::chrono::microseconds(20));
+    }
+    std::sort(samples.begin(), samples.end());
+    return samples[(size_t) (samples.size() * 0.999)];
+}
+
+/**
+ * the tail latency of sendAndStep() with the automatic garbage collector
+ * against the real-time mode collecting in idle time
+ */
+static void benchGC(const string& filename, unsigned int iterations) {
+    rfsm::StateMachine fsm, fsmRealTime;
+    fsmRealTime.setRealTimeGC(true);
+    if(!fsm.load(filename) || !fsmRealTime.load(filename))
+        return;
+    fsm.run();
+    fsmRealTime.run();
+    report("sendAndStep p99.9 (automatic GC)", sendAndStepLatency(fsm, iterations, false));
+    report("sendAndStep p99.9 (real-time GC)", sendAndStepLatency(fsmRealTime, iterations, true));
+    rfsm::GCStats stats = fsmRealTime.getGCStats();
+    cout<<"  "<<stats.cycles<<" GC cycles, "<<stats.maxTime<<" ns max collectGarbage()"<<endl;
+}
+
+/**
+ * sendAndStep() with the embedded rfsm engine keeping the fsm.dbg() calls
+ * against the release one (the same if the engine is not embedded)
+ */
+static void benchEngine(const string& filename, unsigned int iterations) {
+    Stopwatch instrumented, release;
+    rfsm::StateMachine fsm, fsmRelease;
+    fsm.setInstrumentedEngine(true);
+    if(!fsm.load(filename) || !fsmRelease.load(filename))
+        return;
+    fsm.run();
+    fsmRelease.run();
+    instrumented.start();
+    for(unsigned int i=0; i<iterations; i++)
+        fsm.sendAndStep(pingPong(i));
+    instrumented.stop();
+    release.start();
+    for(unsigned int i=0; i<iterations; i++)
+        fsmRelease.sendAndStep(pingPong(i));
+    release.stop();
+    report("sendAndStep (instrumented engine)", instrumented.nsPerOp(iterations));
+    report("sendAndStep (release engine)", release.nsPerOp(iterations));
+}
+
+// the PING/PONG model nested in depth composite states
+static string deepModel(unsigned int depth) {
+    if(depth == 0)
+        return "PING = rfsm.state { },\n"
+               "PONG = rfsm.state { },\n"
+               "rfsm.transition { src='initial', tgt='PING' },\n"
+               "rfsm.transition { src='PING', tgt='PONG', events={ 'e_ping' } },\n"
+               "rfsm.transition { src='PONG', tgt='PING', events={ 'e_pong' } },\n";
+    return "S = rfsm.state {\n" + deepModel(depth - 1) + "},\n"
+           "rfsm.transition { src='initial', tgt='S' },\n";
+}
+
+/**
+ * sendAndStep() between two sibling leaves nested at increasing depths:
+ * the LCA and the entry/exit paths are cached per transition, thus
+ * the cost does not grow with the depth
+ */
+static void benchTransitionDepth(unsigned int iterations) {
+    const unsigned int depths[] = { 1, 4, 16, 64 };
+    for(size_t d=0; d<sizeof(depths)/sizeof(depths[0]); d++) {
+        string filename = "bench_deep_fsm_" + std::to_string(depths[d]) + ".lua";
+        {
+            ofstream model(filename.c_str());
+            model<<"return rfsm.state {\n"<<deepModel(depths[d])<<"}\n";
+        }
+        rfsm::StateMachine fsm;
+        bool loaded = fsm.load(filename);
+        std::remove(filename.c_str());
+        if(!loaded)
+            return;
+        fsm.run();
+        Stopwatch watch;
+        watch.start();
+        for(unsigned int i=0; i<iterations; i++)
+            fsm.sendAndStep(pingPong(i));
+        watch.stop();
+        report("sendAndStep (depth " + std::to_string(depths[d]) + ")", watch.nsPerOp(iterations));
+    }
+}
+
+/**
+ * instantiate() deep-copies the initialized state machine:
+ * its cost grows with the size of the model
+ */
+static void benchInstantiateSize(unsigned int count) {
+    const unsigned int depths[] = { 1, 4, 16, 64 };
+    for(size_t d=0; d<sizeof(depths)/sizeof(depths[0]); d++) {
+        string filename = "bench_deep_fsm_" + std::to_string(depths[d]) + ".lua";
+        {
+            ofstream model(filename.c_str());
+            model<<"return rfsm.state {\n"<<deepModel(depths[d])<<"}\n";
+        }
+        rfsm::StateMachineTemplate model;
+        bool loaded = model.load(filename);
+        std::remove(filename.c_str());
+        if(!loaded)
+            return;
+        Stopwatch instantiate;
+        std::vector<rfsm::StateMachine*> machines;
+        for(unsigned int i=0; i<count; i++) {
+            rfsm::StateMachine* fsm = new rfsm::StateMachine();
+            instantiate.start();
+            model.instantiate(*fsm);
+            instantiate.stop();
+            machines.push_back(fsm);
+        }
+        for(size_t i=0; i<machines.size(); i++)
+            delete machines[i];
+        report("StateMachineTemplate::instantiate (depth " + std::to_string(depths[d]) + ")",
+               instantiate.nsPerOp(count));
+    }
+}
+
+int main(int argc, char** argv) {
+    if(argc < 2) {
+        cout<<"Usage: "<<argv[0]<<" bench_fsm.lua [iterations] [model cache directory]"<<endl;
+        return EXIT_FAILURE;
+    }
+    unsigned int iterations = (argc > 2) ? atoi(argv[2]) : 100000;
+
+    rfsm::StateMachine fsm;
+    if(!fsm.load(argv[1])) {
+        cerr<<"Cannot load "<<argv[1]<<endl;
+        return EXIT_FAILURE;
+    }
+    fsm.run();
+
+    cout<<"rfsmBenchmark: "<<argv[1]<<" ("<<iterations<<" iterations, "<<RFSM_LUA_ENGINE<<")"<<endl;
+    benchLoad(argv[1], 100);
+    if(argc > 3) {
+        benchLoad(argv[1], 100, argv[3]);
+        benchLoad(argv[1], 100, argv[3], true);
+    }
+    benchSendEvent(fsm, iterations);
+    benchSendEventId(fsm, iterations);
+    benchStep(fsm, iterations);
+    benchSendAndStep(fsm, iterations);
+    benchSendEvents(fsm, iterations);
+    benchPostEvent(fsm, iterations);
+    benchTransitionDepth(iterations);
+    benchEngine(argv[1], iterations);
+    benchAllocator(argv[1], iterations);
+    benchGC(argv[1], iterations);
+    benchInstantiate(argv[1], 400);
+    benchInstantiateSize(400);
+    benchHost(argv[1], 400);
+    benchExecutor(argv[1], 400, iterations);
+    return EXIT_SUCCESS;
+}
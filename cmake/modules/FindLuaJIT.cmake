@@ -0,0 +1,49 @@
+# - Try to find the LuaJIT library
+# Once done this will define the same variables as FindLua
+#
+#  LUAJIT_FOUND - system has LuaJIT installed
+#  LUA_FOUND
+#  LUA_INCLUDE_DIR
+#  LUA_LIBRARY
+#  LUA_LIBRARIES
+#  LUA_VERSION_STRING - the LuaJIT version (e.g. 2.1.0-beta3)
+#
+
+if(EXISTS "$ENV{LUAJIT_DIR}")
+    set(LUAJIT_POSSIBLE_INCDIRS "$ENV{LUAJIT_DIR}/include" "$ENV{LUAJIT_DIR}/src")
+    set(LUAJIT_POSSIBLE_LIBRARY_PATHS "$ENV{LUAJIT_DIR}/lib" "$ENV{LUAJIT_DIR}/src")
+endif()
+
+if(NOT WIN32)
+    find_package(PkgConfig)
+    pkg_check_modules(LUAJIT_PKG luajit)
+endif()
+
+find_path(LUA_INCLUDE_DIR luajit.h
+          HINTS ${LUAJIT_PKG_INCLUDE_DIRS}
+          PATHS ${LUAJIT_POSSIBLE_INCDIRS}
+          PATH_SUFFIXES luajit-2.1 luajit-2.0 luajit)
+
+find_library(LUA_LIBRARY NAMES luajit-5.1 luajit lua51
+             HINTS ${LUAJIT_PKG_LIBRARY_DIRS}
+             PATHS ${LUAJIT_POSSIBLE_LIBRARY_PATHS})
+
+if(LUA_INCLUDE_DIR AND EXISTS "${LUA_INCLUDE_DIR}/luajit.h")
+    file(STRINGS "${LUA_INCLUDE_DIR}/luajit.h" LUAJIT_VERSION_LINE
+         REGEX "^#define[ \t]+LUAJIT_VERSION[ \t]+\"LuaJIT .+\"")
+    string(REGEX REPLACE "^#define[ \t]+LUAJIT_VERSION[ \t]+\"LuaJIT ([^\"]+)\".*" "\\1"
+           LUA_VERSION_STRING "${LUAJIT_VERSION_LINE}")
+endif()
+
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(LuaJIT DEFAULT_MSG LUA_LIBRARY LUA_INCLUDE_DIR)
+
+if(LUAJIT_FOUND)
+    set(LUA_FOUND TRUE)
+    set(LUA_LIBRARIES ${LUA_LIBRARY})
+    if(NOT WIN32 AND NOT APPLE)
+        list(APPEND LUA_LIBRARIES m dl)
+    endif()
+endif()
+
+mark_as_advanced(LUA_INCLUDE_DIR LUA_LIBRARY)
@@ -14,6 +14,14 @@
 //        * a list of strings in Python
 %template(StringVector) std::vector<std::string>;
 
+// The varargs StateMachine::sendEvents(unsigned int n, ...) is dropped from the
+// bindings. SWIG does not forward the variable arguments, so the wrapper would
+// read n missing strings. This removes a previously wrapped method: use
+// sendEvents(const std::vector<std::string>&), which takes a StringVector (or a
+// list of strings in Python), instead. The sendEvents() iterator range template
+// is not instantiated, thus it is not wrapped either.
+%ignore rfsm::StateMachine::sendEvents(unsigned int, ...);
+
 %{
 
 #include <rfsm.h>
@@ -10,15 +10,71 @@
 #define RFSM_H
 
 
+#include <chrono>
+#include <cstddef>
 #include <string>
 #include <vector>
 #include <map>
 
 namespace rfsm {
     class StateMachine;
+    class StateMachineTemplate;
+    class StateMachineHost;
     class StateCallback;
+    class TransitionCallback;
     class StateGraph;
     class LuaTraceCallback;
+    class Allocator;
+    class PoolAllocator;
+    struct StepResult;
+    struct MemoryStats;
+    struct GCStats;
+
+    /**
+     * @brief GCMode is the mode of the lua garbage collector
+     */
+    enum GCMode {
+        GCIncremental,
+        GCGenerational
+    };
+
+    /**
+     * @brief EventId is the interned handle of an rFSM event. It is the index
+     * of the event in StateMachine::getEventsList()
+     */
+    typedef int EventId;
+    const EventId InvalidEventId = -1;
+
+    /**
+     * @brief StateId is the index of an rFSM state (see StateMachine::stateName())
+     */
+    typedef int StateId;
+    const StateId InvalidStateId = -1;
+
+    /**
+     * @brief EventHash is the hash of an event name (see eventHash())
+     */
+    typedef unsigned long long EventHash;
+
+    /**
+     * @brief eventHash computes the 64-bit FNV-1a hash of an event name.
+     * It can be evaluated at compile time and resolved into an EventId
+     * by StateMachine::eventId(EventHash)
+     */
+    constexpr EventHash eventHash(const char* event, EventHash hash=14695981039346656037ULL) {
+        return (*event) ? eventHash(event+1, (hash ^ static_cast<unsigned char>(*event)) * 1099511628211ULL) : hash;
+    }
+
+#ifndef SWIG
+    namespace literals {
+        /**
+         * @brief "e_one"_event is the compile time eventHash("e_one")
+         */
+        constexpr EventHash operator"" _event(const char* event, std::size_t) {
+            return eventHash(event);
+        }
+    }
+#endif
 }
 
 #ifndef luaL_reg
@@ -49,6 +105,37 @@ public:
 };
 
 
+/**
+ * @brief The rfsm::TransitionCallback class can be used to implement
+ *  the guard and the effect of rFSM transitions in c++
+ */
+class rfsm::TransitionCallback {
+public:
+    /**
+     * @brief Member selects the members of the callback which replace
+     * the ones of the rFSM transitions (see StateMachine::setTransitionCallback())
+     */
+    enum Member {
+        Guard = 1,
+        Effect = 2
+    };
+
+    virtual ~TransitionCallback() {}
+    /**
+     * @brief guard is called on rFSM transition.guard
+     * @param events the events of the step. The events without an EventId
+     * (e.g. the e_done@ completion events) are not reported
+     * @return false to disable the transition
+     */
+    virtual bool guard(const std::vector<rfsm::EventId>& events) { return true; }
+
+    /**
+     * @brief effect is called on rFSM transition.effect
+     */
+    virtual void effect() {}
+};
+
+
 /**
  * @brief The LuaTraceCallback class
  */
@@ -116,6 +203,152 @@ public:
 };
 
 
+/**
+ * @brief The rfsm::StepResult struct reports the outcome of
+ * stepping or running the state machine
+ */
+struct rfsm::StepResult {
+    StepResult() : idle(false), steps(0), transitions(0),
+        state(InvalidStateId), queueDepth(0) { }
+    /**
+     * @brief idle is true if the state machine has nothing else to do
+     */
+    bool idle;
+    /**
+     * @brief steps is the number of steps consumed
+     */
+    unsigned int steps;
+    /**
+     * @brief transitions is the number of transitions fired
+     */
+    unsigned int transitions;
+    /**
+     * @brief state is the active leaf state (see StateMachine::stateName())
+     */
+    StateId state;
+    /**
+     * @brief queueDepth is the number of events left in the queue
+     */
+    size_t queueDepth;
+};
+
+
+/**
+ * @brief The rfsm::Allocator class can be used to provide the memory
+ * of the lua state of a state machine (see StateMachine::setAllocator())
+ */
+class rfsm::Allocator {
+public:
+    virtual ~Allocator() {}
+    /**
+     * @brief allocate allocates a block of memory
+     * @param size the size of the block in bytes (greater than zero)
+     * @return the block or NULL if it cannot be allocated
+     */
+    virtual void* allocate(size_t size) = 0;
+
+    /**
+     * @brief deallocate releases a block of memory
+     * @param ptr the block given by allocate() or reallocate()
+     * @param size the size of the block
+     */
+    virtual void deallocate(void* ptr, size_t size) = 0;
+
+    /**
+     * @brief reallocate changes the size of a block of memory. The default
+     * implementation copies the block into a new one
+     * @param ptr the block given by allocate() or reallocate()
+     * @param oldSize the current size of the block
+     * @param newSize the new size of the block (greater than zero)
+     * @return the new block or NULL if it cannot be allocated.
+     * In that case ptr is left unchanged
+     */
+    virtual void* reallocate(void* ptr, size_t oldSize, size_t newSize);
+};
+
+
+/**
+ * @brief The rfsm::PoolAllocator class serves the small blocks
+ * (up to 512 bytes) used by lua for strings, tables and closures from
+ * free lists of 16 bytes size classes, refilled by chunks of 64KB.
+ * The larger blocks are taken from malloc().
+ *
+ * \note PoolAllocator is not thread safe and must be used by a single
+ * state machine. The memory of the chunks is released on destruction
+ */
+class rfsm::PoolAllocator : public rfsm::Allocator {
+public:
+    PoolAllocator();
+    virtual ~PoolAllocator();
+    virtual void* allocate(size_t size);
+    virtual void deallocate(void* ptr, size_t size);
+    virtual void* reallocate(void* ptr, size_t oldSize, size_t newSize);
+
+private:
+    PoolAllocator(const PoolAllocator&);
+    PoolAllocator& operator=(const PoolAllocator&);
+
+private:
+    class Private;
+    Private * const mPriv;
+};
+
+
+/**
+ * @brief The rfsm::MemoryStats struct reports the memory
+ * used by the lua state of a state machine
+ */
+struct rfsm::MemoryStats {
+    MemoryStats() : liveBytes(0), peakBytes(0), allocations(0), failures(0) { }
+    /**
+     * @brief liveBytes is the memory currently in use
+     */
+    size_t liveBytes;
+    /**
+     * @brief peakBytes is the highest value of liveBytes
+     */
+    size_t peakBytes;
+    /**
+     * @brief allocations is the number of blocks allocated
+     */
+    unsigned long long allocations;
+    /**
+     * @brief failures is the number of allocations refused by the
+     * allocator or by the memory limit
+     */
+    unsigned long long failures;
+};
+
+
+/**
+ * @brief The rfsm::GCStats struct reports the state of the lua garbage
+ * collector and the work done by StateMachine::collectGarbage()
+ */
+struct rfsm::GCStats {
+    GCStats() : memory(0), steps(0), cycles(0), totalTime(0), maxTime(0) { }
+    /**
+     * @brief memory is the memory in use by lua in bytes
+     */
+    size_t memory;
+    /**
+     * @brief steps is the number of collector steps run by collectGarbage()
+     */
+    unsigned long long steps;
+    /**
+     * @brief cycles is the number of collection cycles completed by collectGarbage()
+     */
+    unsigned long long cycles;
+    /**
+     * @brief totalTime is the time spent in collectGarbage() in nanoseconds
+     */
+    unsigned long long totalTime;
+    /**
+     * @brief maxTime is the longest collectGarbage() call in nanoseconds
+     */
+    unsigned long long maxTime;
+};
+
+
 /**
  * @brief The rfsm::StateMachine class
  */
@@ -142,9 +375,11 @@ public:
     /**
      * @brief loads and initializes a rFSM state machine
      * @param filename rFSM state machine file name
+     * @param extractGraph extracts the state graph at load instead of
+     * at the first getStateGraph() (e.g. for the tools which draw it)
      * @return true on success
      */
-    bool load(const std::string& filename);
+    bool load(const std::string& filename, bool extractGraph=false);
 
     /**
      * @brief run calls rfsm.run()
@@ -159,6 +394,71 @@ public:
      */
     bool step(unsigned int n=1);
 
+    /**
+     * @brief run calls rfsm.run() and reports its outcome
+     * @param result the outcome of the run
+     * @return true on success
+     */
+    bool run(StepResult& result);
+
+    /**
+     * @brief step calls rfsm.step(n) and reports its outcome
+     * @param n number the steps to taken
+     * @param result the outcome of the steps
+     * @return true on success
+     */
+    bool step(unsigned int n, StepResult& result);
+
+#ifndef SWIG
+    /**
+     * @brief runFor runs the state machine as run() does but stops
+     * between two steps once maxSteps steps have been taken or the
+     * time budget is used up (a single step is never interrupted)
+     * @param maxSteps the maximum number of steps
+     * @param budget the time budget
+     * @param result the outcome of the run. result.idle is false if
+     * the state machine still has work to do
+     * @return true on success
+     */
+    bool runFor(unsigned int maxSteps, std::chrono::nanoseconds budget, StepResult& result);
+#endif
+
+    /**
+     * @brief sendAndStep sends an event and steps the state machine
+     * with a single call into lua
+     * @param event the event to be send to the state machine
+     * @param n number the steps to taken (defaule is 1)
+     * @return true on success
+     */
+    bool sendAndStep(const std::string& event, unsigned int n=1);
+
+    /**
+     * @brief sendAndStep sends an event and steps the state machine
+     * with a single call into lua
+     * @param event the event to be send to the state machine
+     * @param n number the steps to taken
+     * @param result the outcome of the steps
+     * @return true on success
+     */
+    bool sendAndStep(const std::string& event, unsigned int n, StepResult& result);
+
+    /**
+     * @brief sendAndStep sends an event given by its id and steps the state machine
+     * @param event the id of the event (see eventId())
+     * @param n number the steps to taken (defaule is 1)
+     * @return true on success
+     */
+    bool sendAndStep(EventId event, unsigned int n=1);
+
+    /**
+     * @brief sendAndStep sends an event given by its id and steps the state machine
+     * @param event the id of the event (see eventId())
+     * @param n number the steps to taken
+     * @param result the outcome of the steps
+     * @return true on success
+     */
+    bool sendAndStep(EventId event, unsigned int n, StepResult& result);
+
     /**
      * @brief sendEvent calls rfsm.send_events(event)
      * @param event a single event to be send to the state machine
@@ -166,6 +466,14 @@ public:
      */
     bool sendEvent(const std::string& event);
 
+    /**
+     * @brief sendEvent sends an event given by its interned id. No check
+     * is done on the event name
+     * @param event the id of the event (see eventId())
+     * @return true on success
+     */
+    bool sendEvent(EventId event);
+
     /**
      * @brief sendEvents calls rfsm.send_events(...)
      * @param n number of events to be send
@@ -174,6 +482,129 @@ public:
      */
     bool sendEvents(unsigned int n, ...);
 
+    /**
+     * @brief sendEvents pushes a list of events into the rFSM event queue
+     * within a single call to lua
+     * @param events the events to be sent
+     * @return true on success
+     */
+    bool sendEvents(const std::vector<std::string>& events);
+
+    /**
+     * @brief sendEvents pushes a list of events given by their interned ids
+     * into the rFSM event queue within a single call to lua
+     * @param events the ids of the events to be sent
+     * @return true on success
+     */
+    bool sendEvents(const std::vector<EventId>& events);
+
+    /**
+     * @brief sendEvents pushes the events in the range [first, last)
+     * into the rFSM event queue within a single call to lua
+     * @param first iterator to the first event (std::string or const char*)
+     * @param last iterator past the last event
+     * @return true on success
+     */
+    template<typename InputIterator>
+    bool sendEvents(InputIterator first, InputIterator last) {
+        std::vector<const char*> events;
+        for(; first != last; ++first)
+            events.push_back(eventName(*first));
+        return sendEventList(events);
+    }
+
+    /**
+     * @brief postEvent queues an event from any thread without accessing lua.
+     * The posted events are merged into the rFSM event queue by fsm.getevents
+     * at the beginning of the next step
+     * @param event the event name
+     * @return false if the state machine is not loaded or the queue is full
+     *
+     * \note postEvent must not be called concurrently with load() or close()
+     */
+    bool postEvent(const std::string& event);
+
+    /**
+     * @brief postEvent queues an event given by its id from any thread
+     * (see postEvent(const std::string&))
+     * @param event the id of the event (see eventId())
+     * @return false if the state machine is not loaded or the queue is full
+     */
+    bool postEvent(EventId event);
+
+    /**
+     * @brief setPostQueueSize sets the capacity of the queue used by postEvent()
+     * (default is 256 events)
+     * @param size number of events that can be posted between two steps
+     *
+     * \note This should be called before load()
+     */
+    void setPostQueueSize(size_t size);
+
+    /**
+     * @brief setAllocator sets the allocator of the lua state
+     * (default is the system realloc())
+     * @param allocator the allocator (e.g. a PoolAllocator) or NULL for the
+     * default one. It must outlive the lua state of this state machine
+     *
+     * \note This should be called before load()
+     */
+    void setAllocator(rfsm::Allocator* allocator);
+
+    /**
+     * @brief setMemoryLimit sets the maximum memory of the lua state.
+     * The allocations beyond the limit fail and the call which requested
+     * them (e.g. load() or sendEvent()) reports the error ("not enough
+     * memory") and returns false. It can be changed at any time
+     * @param bytes the limit in bytes (0 is no limit, the default)
+     */
+    void setMemoryLimit(size_t bytes);
+
+    /**
+     * @brief getMemoryStats reports the memory used by the lua state.
+     * The instances of a StateMachineTemplate and the machines hosted by a
+     * StateMachineHost do not own a lua state and report no memory
+     * (see StateMachineHost::getFootprint())
+     * @return the memory statistics
+     */
+    rfsm::MemoryStats getMemoryStats();
+
+    /**
+     * @brief setGCMode sets the mode of the garbage collector
+     * (default is GCIncremental)
+     * @param mode the garbage collector mode. GCGenerational requires lua 5.4
+     * @return false if the mode is not supported by lua
+     */
+    bool setGCMode(rfsm::GCMode mode);
+
+    /**
+     * @brief setRealTimeGC stops the automatic garbage collection so that it
+     * never runs while stepping the state machine nor after the failed calls.
+     * The garbage must then be collected by collectGarbage() in idle time.
+     * @param enable true to enable the real-time mode (default is false)
+     *
+     * \note The garbage collector of the instances of a StateMachineTemplate
+     * and of the machines hosted by a StateMachineHost is the one of
+     * the shared lua state
+     */
+    void setRealTimeGC(bool enable);
+
+#ifndef SWIG
+    /**
+     * @brief collectGarbage runs incremental steps of the garbage
+     * collector until a cycle is completed or the time budget is used up
+     * @param budget the time budget
+     * @return true if a collection cycle has been completed
+     */
+    bool collectGarbage(std::chrono::nanoseconds budget);
+#endif
+
+    /**
+     * @brief getGCStats reports the statistics of the garbage collector
+     * @return the garbage collector statistics
+     */
+    rfsm::GCStats getGCStats();
+
     /**
      * @brief doString execute a generic lua command
      * @param command a string containg a valid lua command
@@ -194,6 +625,30 @@ public:
      */
     void addLuaPackagePath(const std::string& path);
 
+    /**
+     * @brief setInstrumentedEngine selects the rfsm engine used by the next load().
+     * The engine embedded in the library (EMBED_RFSM) is built without the
+     * fsm.dbg() calls of its hot paths, the instrumented one keeps them
+     * for the models which print the debug messages (dbg printer).
+     * It has no effect if the rfsm engine is not embedded.
+     * @param enable true to use the instrumented engine (default is false)
+     */
+    void setInstrumentedEngine(bool enable);
+
+    /**
+     * @brief setModelCache enables the cache of the compiled models used by
+     * the next load(). The bytecode of the rFSM file and of the lua files it
+     * requires is stored in the directory, keyed by the hash of their content
+     * and by the lua engine, and it is loaded instead of parsing the unchanged
+     * files again. In trusted mode a model whose files have been already
+     * verified by a previous load() is not verified again.
+     * \note the directory must exist and must not be writable by untrusted
+     * users since lua does not validate the loaded bytecode
+     * @param directory the cache directory (an empty string disables the cache)
+     * @param trusted skip the verification of the already verified models
+     */
+    void setModelCache(const std::string& directory, bool trusted=false);
+
     /**
      * @brief closes the state machine if it is already loaded
      */
@@ -207,18 +662,80 @@ public:
      */
     bool setStateCallback(const std::string& state, rfsm::StateCallback& callback);
 
+    /**
+     * @brief setStateCallbacks set the StateCallback objects of many states at once
+     * @param callbacks the callbacks indexed by the state names
+     * @return true on success. The unknown states are reported
+     * together and the callbacks of the other states are set anyway
+     */
+    bool setStateCallbacks(const std::map<std::string, rfsm::StateCallback*>& callbacks);
+
+    /**
+     * @brief setTransitionCallback set a TransitionCallback object for the
+     * transitions between two states
+     * @param source the source state (as in StateGraph::Transition::source)
+     * @param target the target state (as in StateGraph::Transition::target).
+     * For a composite state "X" the transitions to "X.initial" are matched too
+     * @param callback an object of TransitionCallback class
+     * @param members the members of the callback which replace the ones of the
+     * transitions (TransitionCallback::Member). The other members are kept, e.g.
+     * a callback which implements only the effect keeps the lua guard
+     * @return true on success
+     */
+    bool setTransitionCallback(const std::string& source, const std::string& target,
+                               rfsm::TransitionCallback& callback,
+                               unsigned int members=rfsm::TransitionCallback::Guard |
+                                                    rfsm::TransitionCallback::Effect);
+
     /**
      * @brief getCurrentState returns the current activated state
      * @return the name of current active state
      */
     const std::string getCurrentState();
 
+    /**
+     * @brief stateName returns the name of a state given by its id
+     * @param state the id of the state (e.g. StepResult::state)
+     * @return the state name or an empty string if the id is not valid
+     */
+    const std::string stateName(StateId state);
+
+    /**
+     * @brief stateId resolves a state name into its id
+     * @param state the state name as returned by getCurrentState()
+     * @return the state id or InvalidStateId if the state does not exist
+     */
+    StateId stateId(const std::string& state);
+
+    /**
+     * @brief getActiveConfiguration retrieves the chain of the active states
+     * from the outermost state to the current one
+     * @param states the names of the active states
+     * @return true on success
+     */
+    bool getActiveConfiguration(std::vector<std::string>& states);
+
     /**
      * @brief getEventsList retrieves all available events in the state machine
      * @return a list of all available events
      */
     const std::vector<std::string>& getEventsList();
 
+    /**
+     * @brief eventId resolves an event name into its interned id
+     * @param event the event name
+     * @return the event id or InvalidEventId if the event is not defined
+     */
+    EventId eventId(const std::string& event);
+
+    /**
+     * @brief eventId resolves an event hash (e.g. computed at compile time
+     * with rfsm::eventHash()) into its interned id
+     * @param hash the event hash
+     * @return the event id or InvalidEventId if the event is not defined
+     */
+    EventId eventId(EventHash hash);
+
     /**
      * @brief getEventQueue gets the current events in the rFSM event queue
      * @param equeue a vector of string to be filled with the current events
@@ -227,8 +744,13 @@ public:
     bool getEventQueue(std::vector<std::string>& equeue);
 
     /**
-     * @brief getStateGraph return the rFSM state graph
+     * @brief getStateGraph return the rFSM state graph. The graph is
+     * extracted from the lua state by the first call (see load())
      * @return rFSM state graph
+     *
+     * \note The first call runs lua code and it is not thread-safe. The
+     * graph of a machine run by an rfsm::Executor is extracted by
+     * Executor::add()
      */
     const rfsm::StateGraph& getStateGraph();
 
@@ -274,6 +796,14 @@ public:
      */
     virtual void onPostStep();
 
+    /**
+     * @brief this is called when a leaf state becomes active, before
+     *        its entry function is executed
+     * @param previous the previous active leaf state ("<none>" at the first entry)
+     * @param current the new active leaf state
+     */
+    virtual void onStateChanged(const std::string& previous, const std::string& current);
+
     /**
      * @brief this is called on every warning message generated from rFSM
      *        in verbose mode (i.e. StateMachine(bool verbose=true) )
@@ -302,10 +832,189 @@ private:
     virtual void onTrace(const std::string& message );
 
 private:
+    static const char* eventName(const std::string& event) { return event.c_str(); }
+    static const char* eventName(const char* event) { return event; }
+    bool sendEventList(const std::vector<const char*>& events);
+
+private:
+    friend class rfsm::StateMachineTemplate;
+    friend class rfsm::StateMachineHost;
 	class Private;
     Private * const mPriv;
     bool verbose;
 };
 
 
+/**
+ * @brief The rfsm::StateMachineTemplate class loads and initializes a rFSM
+ * state machine once and instantiates it into many StateMachine objects.
+ * The instances share the lua state and the code of the template and each
+ * of them runs a deep copy of the initialized state machine.
+ *
+ * \note Closing or destroying the template closes its instances. The
+ * instances of a template must be used from the same thread and share the
+ * lua globals (e.g. print() redirected by StateMachine::catchPrintOutput())
+ */
+class rfsm::StateMachineTemplate {
+public:
+    /**
+     * @brief StateMachineTemplate
+     */
+    StateMachineTemplate();
+
+    /**
+     * @brief ~StateMachineTemplate
+     */
+    virtual ~StateMachineTemplate();
+
+    /**
+     * @brief getFileName
+     * @return the loaded rFSM state machine's name
+     */
+    const std::string getFileName();
+
+    /**
+     * @brief loads and initializes a rFSM state machine to be instantiated
+     * @param filename rFSM state machine file name
+     * @return true on success
+     */
+    bool load(const std::string& filename);
+
+    /**
+     * @brief instantiate closes the given state machine and makes it a new
+     * instance of the loaded one. Nothing is parsed or verified again but
+     * the initialized state machine is deep-copied, thus the cost grows
+     * with the size of the model
+     * @param machine the state machine to be instantiated
+     * @return true on success
+     */
+    bool instantiate(rfsm::StateMachine& machine);
+
+    /**
+     * @brief addLuaPackagePath add a new path to lua package.path
+     * @param path to a folder containg lua packages
+     */
+    void addLuaPackagePath(const std::string& path);
+
+    /**
+     * @brief closes the template if it is already loaded
+     */
+    void close();
+
+    /**
+     * @brief getEventsList retrieves all available events in the state machine
+     * @return a list of all available events
+     */
+    const std::vector<std::string>& getEventsList();
+
+    /**
+     * @brief getStateGraph return the rFSM state graph. The graph is
+     * extracted from the lua state by the first call
+     * @return rFSM state graph
+     */
+    const rfsm::StateGraph& getStateGraph();
+
+private:
+    StateMachineTemplate(const StateMachineTemplate&);
+    StateMachineTemplate& operator=(const StateMachineTemplate&);
+
+private:
+    rfsm::StateMachine::Private * const mPriv;
+};
+
+
+/**
+ * @brief The rfsm::StateMachineHost class keeps many rFSM state machines
+ * in a single lua state where the rfsm package is loaded once. Each of them
+ * has its own event queue and callbacks and its rFSM file runs in its own
+ * environment table, so the globals it defines are not seen by the others.
+ * The hosted machines can be stepped on demand or in turn by step().
+ *
+ * \note Closing the host closes its machines. The hosted machines
+ * must be used from the same thread
+ */
+class rfsm::StateMachineHost {
+public:
+    /**
+     * @brief StateMachineHost
+     */
+    StateMachineHost();
+
+    /**
+     * @brief ~StateMachineHost
+     */
+    virtual ~StateMachineHost();
+
+    /**
+     * @brief open creates the shared lua state and loads the rfsm package
+     * @return true on success
+     */
+    bool open();
+
+    /**
+     * @brief addLuaPackagePath add a new path to lua package.path
+     * @param path to a folder containg lua packages
+     *
+     * \note This should be called before open()
+     */
+    void addLuaPackagePath(const std::string& path);
+
+    /**
+     * @brief load closes the given state machine and loads a rFSM state machine
+     * into it as StateMachine::load() does, using the lua state of the host
+     * @param machine the state machine to be hosted
+     * @param filename rFSM state machine file name
+     * @return true on success
+     */
+    bool load(rfsm::StateMachine& machine, const std::string& filename);
+
+    /**
+     * @brief step steps every hosted state machine n steps in turn
+     * @param n number the steps to taken by each machine (defaule is 1)
+     * @return false if any of the machines failed
+     */
+    bool step(unsigned int n=1);
+
+    /**
+     * @brief stepNext steps the next hosted state machine in turn
+     * @param n number the steps to taken (defaule is 1)
+     * @return true on success
+     */
+    bool stepNext(unsigned int n=1);
+
+    /**
+     * @brief getMachineCount
+     * @return the number of hosted state machines
+     */
+    size_t getMachineCount();
+
+    /**
+     * @brief getMemoryUsage
+     * @return the memory used by the shared lua state in bytes
+     */
+    size_t getMemoryUsage();
+
+    /**
+     * @brief getFootprint returns the memory taken by a hosted state machine,
+     * measured as the growth of the lua state while it was loaded. It is an
+     * estimate since the garbage is not collected before the measure
+     * @param machine a hosted state machine
+     * @return the footprint in bytes or 0 if the machine is not hosted
+     */
+    size_t getFootprint(const rfsm::StateMachine& machine);
+
+    /**
+     * @brief closes the hosted state machines and the lua state
+     */
+    void close();
+
+private:
+    StateMachineHost(const StateMachineHost&);
+    StateMachineHost& operator=(const StateMachineHost&);
+
+private:
+    rfsm::StateMachine::Private * const mPriv;
+};
+
+
 #endif // RFSM_H
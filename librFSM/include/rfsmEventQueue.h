@@ -0,0 +1,123 @@
+// -*- mode:C++; tab-width:4; c-basic-offset:4; indent-tabs-mode:nil -*-
+
+/*
+ * Copyright (C) 2017 iCub Facility
+ * Authors: Ali Paikan <ali.paikan@iit.it>, Nicolo' Genesio <nicolo.genesio@iit.it>
+ * CopyPolicy: Released under the terms of the LGPLv2.1 or later, see LGPL.TXT
+ */
+
+#ifndef RFSM_EVENT_QUEUE_H
+#define RFSM_EVENT_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include <rfsm.h>
+
+namespace rfsm {
+    class ConcurrentEventQueue;
+}
+
+
+/**
+ * @brief The ConcurrentEventQueue class is a bounded lock-free
+ * multi-producer single-consumer ring buffer of events.
+ * Every slot carries a sequence number which tells the producers and the
+ * consumer whether the slot is free or holds an event (D. Vyukov's bounded
+ * queue). push() can be called from any thread, pop() only from the thread
+ * which owns the lua state.
+ */
+class rfsm::ConcurrentEventQueue {
+public:
+    /**
+     * @brief ConcurrentEventQueue
+     * @param size the capacity of the queue, rounded up to a power of two
+     */
+    explicit ConcurrentEventQueue(size_t size)
+        : slots(capacity(size)), mask(slots.size() - 1), enqueuePos(0), dequeuePos(0) {
+        for(size_t i=0; i<slots.size(); i++)
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief push adds an event to the queue. The event is given either by its
+     * name or by its id (the name is ignored if id is not InvalidEventId)
+     * @return false if the queue is full
+     */
+    bool push(const std::string& event, EventId id=InvalidEventId) {
+        Slot* slot;
+        size_t pos = enqueuePos.load(std::memory_order_relaxed);
+        for(;;) {
+            slot = &slots[pos & mask];
+            size_t seq = slot->sequence.load(std::memory_order_acquire);
+            std::ptrdiff_t dif = (std::ptrdiff_t) seq - (std::ptrdiff_t) pos;
+            if(dif == 0) {
+                if(enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if(dif < 0)
+                return false;
+            else
+                pos = enqueuePos.load(std::memory_order_relaxed);
+        }
+        slot->id = id;
+        if(id == InvalidEventId)
+            slot->event = event;
+        slot->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @brief pop takes the oldest event from the queue (single consumer).
+     * The event name is swapped into the given string to recycle its storage
+     * @return false if the queue is empty
+     */
+    bool pop(std::string& event, EventId& id) {
+        Slot* slot = &slots[dequeuePos & mask];
+        size_t seq = slot->sequence.load(std::memory_order_acquire);
+        if((std::ptrdiff_t) seq - (std::ptrdiff_t) (dequeuePos + 1) < 0)
+            return false;
+        id = slot->id;
+        if(id == InvalidEventId)
+            event.swap(slot->event);
+        slot->sequence.store(dequeuePos + mask + 1, std::memory_order_release);
+        dequeuePos++;
+        return true;
+    }
+
+    /**
+     * @brief empty (consumer side)
+     */
+    bool empty() const {
+        const Slot& slot = slots[dequeuePos & mask];
+        return ((std::ptrdiff_t) slot.sequence.load(std::memory_order_acquire)
+                - (std::ptrdiff_t) (dequeuePos + 1) < 0);
+    }
+
+private:
+    static size_t capacity(size_t size) {
+        size_t capacity = 2;
+        while(capacity < size)
+            capacity <<= 1;
+        return capacity;
+    }
+
+    struct Slot {
+        Slot() : sequence(0), id(InvalidEventId) { }
+        std::atomic<size_t> sequence;
+        std::string event;
+        EventId id;
+    };
+
+    std::vector<Slot> slots;
+    size_t mask;
+    // keep the producers and the consumer indices on separate cache lines
+    char pad0[64];
+    std::atomic<size_t> enqueuePos;
+    char pad1[64];
+    size_t dequeuePos;
+};
+
+#endif // RFSM_EVENT_QUEUE_H
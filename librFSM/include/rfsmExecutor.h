@@ -0,0 +1,157 @@
+// -*- mode:C++; tab-width:4; c-basic-offset:4; indent-tabs-mode:nil -*-
+
+/*
+ * Copyright (C) 2017 iCub Facility
+ * Authors: Ali Paikan <ali.paikan@iit.it>, Nicolo' Genesio <nicolo.genesio@iit.it>
+ * CopyPolicy: Released under the terms of the LGPLv2.1 or later, see LGPL.TXT
+ */
+
+#ifndef RFSM_EXECUTOR_H
+#define RFSM_EXECUTOR_H
+
+#include <chrono>
+#include <string>
+
+#include <rfsm.h>
+
+namespace rfsm {
+    class Executor;
+    struct ExecutorStats;
+}
+
+
+/**
+ * @brief The rfsm::ExecutorStats struct reports the work done
+ * by an Executor since it was created
+ */
+struct rfsm::ExecutorStats {
+    ExecutorStats() : tasks(0), steps(0), transitions(0), steals(0), wakeups(0) { }
+    /**
+     * @brief tasks is the number of times a state machine has been run
+     */
+    unsigned long long tasks;
+    /**
+     * @brief steps is the number of steps taken by the state machines
+     */
+    unsigned long long steps;
+    /**
+     * @brief transitions is the number of transitions fired
+     */
+    unsigned long long transitions;
+    /**
+     * @brief steals is the number of tasks taken from the queue of another worker
+     */
+    unsigned long long steals;
+    /**
+     * @brief wakeups is the number of state machines scheduled by wake()
+     */
+    unsigned long long wakeups;
+};
+
+
+/**
+ * @brief The rfsm::Executor class runs many independent state machines
+ * on a pool of worker threads. A state machine is scheduled when it is
+ * woken up (e.g. by postEvent()) and it is run by StateMachine::runFor()
+ * within the task budget. It is scheduled again while it is not idle
+ * (e.g. it has pending events or a running doo). Each worker has its own
+ * queue of tasks and the idle workers steal the tasks of the others.
+ * A state machine is never run by two workers at the same time.
+ *
+ * \note The state machines which share a lua state (see StateMachineTemplate
+ * and StateMachineHost) must not be added to an executor. A state machine
+ * must be removed before it is loaded, closed or destroyed.
+ */
+class rfsm::Executor {
+public:
+    /**
+     * @brief Executor
+     * @param threads number of the worker threads
+     * (default is the number of cores)
+     */
+    Executor(unsigned int threads=0);
+
+    /**
+     * @brief ~Executor stops the workers
+     */
+    virtual ~Executor();
+
+    /**
+     * @brief start starts the worker threads
+     * @return true on success
+     */
+    bool start();
+
+    /**
+     * @brief stop stops the worker threads after their current tasks.
+     * The scheduled state machines are run again after start()
+     */
+    void stop();
+
+    /**
+     * @brief add adds a loaded state machine to the executor and schedules it.
+     * The state graph of the machine is extracted before it is scheduled,
+     * thus StateMachine::getStateGraph() can be called while it is run
+     * @param machine the state machine
+     * @return false if the machine has been already added
+     */
+    bool add(rfsm::StateMachine& machine);
+
+    /**
+     * @brief remove removes a state machine, waiting for its current run
+     * @param machine the state machine
+     * @return false if the machine was not added
+     */
+    bool remove(rfsm::StateMachine& machine);
+
+    /**
+     * @brief wake schedules a state machine if it is not already scheduled.
+     * It can be called from any thread.
+     * @param machine the state machine
+     * @return false if the machine was not added
+     */
+    bool wake(rfsm::StateMachine& machine);
+
+    /**
+     * @brief postEvent posts an event to a state machine
+     * (see StateMachine::postEvent()) and wakes it up
+     * @param machine the state machine
+     * @param event the event name
+     * @return true on success
+     */
+    bool postEvent(rfsm::StateMachine& machine, const std::string& event);
+
+    /**
+     * @brief postEvent posts an event given by its id to a state machine
+     * (see StateMachine::postEvent()) and wakes it up
+     * @param machine the state machine
+     * @param event the id of the event
+     * @return true on success
+     */
+    bool postEvent(rfsm::StateMachine& machine, EventId event);
+
+    /**
+     * @brief setTaskBudget bounds a single run of a state machine
+     * (default is 100 steps and 1 ms)
+     * @param maxSteps the maximum number of steps
+     * @param budget the time budget
+     */
+    void setTaskBudget(unsigned int maxSteps, std::chrono::nanoseconds budget);
+
+    /**
+     * @brief getStats
+     * @return the throughput counters of the executor
+     */
+    rfsm::ExecutorStats getStats();
+
+private:
+    Executor(const Executor&);
+    Executor& operator=(const Executor&);
+
+private:
+    class Private;
+    Private * const mPriv;
+};
+
+
+#endif // RFSM_EXECUTOR_H
@@ -22,6 +22,10 @@ namespace rfsm {
     #define LUA_OK      0
 #endif
 
+#if LUA_VERSION_NUM > 501 && !defined(lua_objlen)
+    #define lua_objlen(L,i) lua_rawlen(L, (i))
+#endif
+
 #ifndef yError
     #include <iostream>
     #include <assert.h>
@@ -36,7 +40,7 @@ namespace rfsm {
 #endif
 
 #define EVENT_RETREIVE_CHUNK \
-"function rfsm_get_all_events()\n"\
+"function rfsm_get_all_events(fsm)\n"\
 "    local known_events = { e_init_fsm=true, }\n"\
 "    rfsm.mapfsm(function(t)\n"\
 "           local events = t.events or {}\n"\
@@ -52,39 +56,115 @@ namespace rfsm {
 "    return a\n"\
 "end"
 
-#define SET_STATE_CALLBACKS_CHUNK \
-"function rfsm_set_state_callbacks(name)\n"\
+#define DOO_WRAPPER_CHUNK \
+"function rfsm_doo_wrapper(doo)\n"\
+"    return function() doo() end\n"\
+"end"
+
+#define SET_TRANSITION_CALLBACK_CHUNK \
+"function rfsm_set_transition_callback(fsm, src, tgt, guard, effect)\n"\
 "    local found = false\n"\
-"    local function proc_node(state)\n"\
-"       if state._fqn == ('root.' .. name) then\n"\
-"           state.entry = function() RFSM.entryCallback(name) end\n"\
-"           state.doo = function() RFSM.dooCallback(name) end\n"\
-"           state.exit = function() RFSM.exitCallback(name) end\n"\
-"           found = true\n"\
-"        end\n"\
-"    end\n"\
+"    rfsm.mapfsm(function (t)\n"\
+"          if type(t.tgt) ~= 'table' then return end\n"\
+"          local tgt_fqn = t.tgt._fqn\n"\
+"          if t.src._fqn == ('root.' .. src) and\n"\
+"             (tgt_fqn == ('root.' .. tgt) or tgt_fqn == ('root.' .. tgt .. '.initial')) then\n"\
+"             if guard then t.guard = guard end\n"\
+"             if effect then t.effect = effect end\n"\
+"             found = true\n"\
+"          end\n"\
+"          end, fsm, rfsm.is_trans)\n"\
+"    return found\n"\
+"end"
+
+#define INDEX_STATES_CHUNK \
+"function rfsm_index_states(fsm)\n"\
+"    local states = {}\n"\
+"    local nodes = {}\n"\
 "    rfsm.mapfsm(function (s)\n"\
-"          if rfsm.is_root(s) then return end\n"\
-"          if found == true then return end\n"\
-"          proc_node(s)\n"\
+"          states[#states+1] = { s._fqn, rfsm.is_leaf(s) }\n"\
+"          nodes[#states] = s\n"\
+"          s._cid = #states - 1\n"\
+"          end, fsm, rfsm.is_state)\n"\
+"    return states, nodes\n"\
+"end"
+
+#define DISPATCH_TABLES_CHUNK \
+"function rfsm_dispatch_tables(fsm)\n"\
+"    local nodes, trans, bits, otrs = {}, {}, {}, {}\n"\
+"    local nbits = 0\n"\
+"    rfsm.mapfsm(function (nd)\n"\
+"          nodes[#nodes+1] = nd\n"\
+"          nodes[nd] = #nodes\n"\
 "          end, fsm, rfsm.is_node)\n"\
-"    return found\n"\
+"    for i,nd in ipairs(nodes) do\n"\
+"       otrs[i] = {}\n"\
+"       for _,tr in ipairs(nd._otrs or {}) do\n"\
+"          trans[#trans+1] = tr\n"\
+"          local kind = 0\n"\
+"          if rfsm.is_leaf(tr.tgt) then kind = 1\n"\
+"          elseif rfsm.is_conn(tr.tgt) then kind = 2 end\n"\
+"          local events = false\n"\
+"          if tr.events and #tr.events > 0 then\n"\
+"             events = {}\n"\
+"             for e in pairs(tr._idx_events or {}) do\n"\
+"                if not bits[e] then bits[e] = nbits; nbits = nbits + 1 end\n"\
+"                events[#events+1] = bits[e]\n"\
+"             end\n"\
+"          end\n"\
+"          otrs[i][#otrs[i]+1] = { #trans, nodes[tr.tgt] or 0, kind, events }\n"\
+"       end\n"\
+"    end\n"\
+"    return nodes, trans, bits, otrs, nbits\n"\
 "end"
 
-#define GET_CURRENT_STATE_CHUNK \
-"function rfsm_get_current_state()\n"\
-"    function get_active_state(node)\n"\
-"      if node._actchild._actchild == nil or node._actchild._actchild == node._actchild then return node._actchild._fqn end\n"\
-"      return get_active_state(node._actchild)\n"\
+#define LOAD_ISOLATED_CHUNK \
+"function rfsm_load_isolated(file)\n"\
+"    local env = setmetatable({}, { __index = _G })\n"\
+"    local chunk, err\n"\
+"    if setfenv then\n"\
+"       chunk, err = loadfile(file)\n"\
+"       if chunk then setfenv(chunk, env) end\n"\
+"    else\n"\
+"       chunk, err = loadfile(file, 'bt', env)\n"\
+"    end\n"\
+"    if not chunk then error(err, 0) end\n"\
+"    local fsm = chunk()\n"\
+"    if not rfsm.is_state(fsm) then\n"\
+"       error(\"rfsm.load: no valid rfsm in file '\" .. tostring(file) .. \"' found.\")\n"\
 "    end\n"\
-"    if fsm == nil or type(fsm) ~= 'table' then return '<none>' end\n"\
-"    if not fsm._actchild then return '<none>' end\n"\
-"    return get_active_state(fsm)\n"\
+"    return fsm\n"\
+"end"
+
+// installs the compiled chunk loader of the model cache and a
+// searcher which loads the required lua files through it
+#define MODEL_CACHE_CHUNK \
+"function rfsm_install_model_cache(loadfile)\n"\
+"    local searchpath = package.searchpath or function(name, path)\n"\
+"       name = string.gsub(name, '%.', '/')\n"\
+"       for template in string.gmatch(path, '[^;]+') do\n"\
+"          local file = string.gsub(template, '%?', name)\n"\
+"          local f = io.open(file, 'r')\n"\
+"          if f then f:close() return file end\n"\
+"       end\n"\
+"    end\n"\
+"    local searchers = package.searchers or package.loaders\n"\
+"    table.insert(searchers, 2, function(name)\n"\
+"       local file = searchpath(name, package.path)\n"\
+"       if file then return loadfile(file), file end\n"\
+"    end)\n"\
+"    rfsm_cached_loadfile = loadfile\n"\
+"end"
+
+#define INSTANTIATE_CHUNK \
+"function rfsm_instantiate(fsm, nodes)\n"\
+"    local copy = utils.deepcopy({ fsm, nodes })\n"\
+"    return copy[1], copy[2]\n"\
 "end"
 
 
 #define GET_ALL_STATES_CHUNK \
-"function rfsm_get_all_states()\n"\
+"function rfsm_get_all_states(fsm)\n"\
 "    local nodes = {}\n"\
 "    local function getFunctionInfo(func)\n"\
 "         if func == nil then\n"\
@@ -113,7 +193,7 @@ namespace rfsm {
 "end"
 
 #define GET_ALL_TRANSITIONS_CHUNK \
-"function rfsm_get_all_transitions()\n"\
+"function rfsm_get_all_transitions(fsm)\n"\
 "    local trans = {}\n"\
 "    local function proc_trans(t, parent)\n"\
 "       if t.tgt == 'internal' then return true\n"\
@@ -129,7 +209,7 @@ namespace rfsm {
 "end"
 
 #define GET_EVET_QUEUE_CHUNK \
-"function rfsm_get_event_queue()\n"\
+"function rfsm_get_event_queue(fsm)\n"\
 "   rfsm.check_events(fsm)\n"\
 "   return fsm._intq\n"\
 "end"\
@@ -137,66 +217,55 @@ namespace rfsm {
 #define RFSM_NULL_FUNCTION_CHUNK \
 "function rfsm_null_func() return end\n"
 
-#define PRE_STEP_HOOK_CHUNK \
-"function rfsm_pre_step_hook() RFSM.preStepCallback() end\n"
-
-#define POST_STEP_HOOK_CHUNK \
-"function rfsm_post_step_hook() RFSM.postStepCallback() end\n"
-
-#if LUA_VERSION_NUM > 501
-#define RFSM_PACK_ARGS_CHUNK \
-"function rfsm_pack_args(...)\n"\
-"  res = ''\n"\
-"  local arguments=arg \n"\
-"  if arguments==nil then arguments = table.pack(...) end\n"\
-"  for i,v in ipairs(arguments) do\n"\
-"    res = res .. tostring(v) .. ' '\n"\
-"  end\n"\
-"  return res\n"\
-"end"
-#else
-#define RFSM_PACK_ARGS_CHUNK \
-"function rfsm_pack_args(...)\n"\
-"  res = ''\n"\
-"  for i,v in ipairs(arg) do\n"\
-"    res = res .. tostring(v) .. ' '\n"\
-"  end\n"\
-"  return res\n"\
-"end"
-
-#endif
-
-#define RFSM_WARNING_CHUNK \
-"function rfsm_warning(...)\n"\
-"  RFSM.warningCallback(rfsm_pack_args(...))\n"\
-"end"
-
-#define RFSM_ERROR_CHUNK \
-"function rfsm_error(...)\n"\
-"  RFSM.errorCallback(rfsm_pack_args(...))\n"\
-"end"
-
-#define RFSM_INFO_CHUNK \
-"function rfsm_info(...)\n"\
-"  RFSM.infoCallback(rfsm_pack_args(...))\n"\
-"end"
+// all the auxiliary functions loaded as a single chunk
+// (embedded as bytecode by embedRes --auxiliary)
+#define RFSM_AUXILIARY_CHUNK \
+RFSM_NULL_FUNCTION_CHUNK "\n" \
+EVENT_RETREIVE_CHUNK "\n" \
+DOO_WRAPPER_CHUNK "\n" \
+SET_TRANSITION_CALLBACK_CHUNK "\n" \
+INDEX_STATES_CHUNK "\n" \
+DISPATCH_TABLES_CHUNK "\n" \
+INSTANTIATE_CHUNK "\n" \
+LOAD_ISOLATED_CHUNK "\n" \
+MODEL_CACHE_CHUNK "\n" \
+GET_ALL_STATES_CHUNK "\n" \
+GET_ALL_TRANSITIONS_CHUNK "\n" \
+GET_EVET_QUEUE_CHUNK "\n"
 
 
 class rfsm::Utils {
 public:
-    static int report (lua_State *L, int status);
+    /**
+     * the error is reported to the given callback or, if it is NULL,
+     * to the trace callback of the lua state
+     */
+    static int report (lua_State *L, int status, LuaTraceCallback* callback=NULL);
     static int traceback (lua_State *L);
-    static int docall(lua_State *L, int narg, int clear);
-    static int dofile(lua_State *L, const char *name);
-    static int dostring (lua_State *L, const char *s, const char *name);
+    /**
+     * a full garbage collection follows the errors unless collect is false
+     * (the collector of the lua state is stopped, see StateMachine::setRealTimeGC())
+     */
+    static int docall(lua_State *L, int narg, int clear, bool collect=true);
+    static int dofile(lua_State *L, const char *name, bool collect=true);
+    static int dostring (lua_State *L, const char *s, const char *name, bool collect=true);
+    static int dobuffer (lua_State *L, const char *buff, size_t size, const char *name, bool collect=true);
     static int dolibrary (lua_State *L, const char *name);
+    /**
+     * calls func in protected mode with ud as its only argument (a light
+     * userdata). Nothing is allocated out of the protected call, so the
+     * errors of func (e.g. a refused allocation) never reach the panic
+     * function of the lua state
+     */
+    static int cpcall(lua_State *L, lua_CFunction func, void *ud);
     static int getTableNumberField(lua_State *L, const char *key);
     static std::string getTableStringField(lua_State *L, const char *key);    
     static bool isNilTableField(lua_State *L, const char *key);    
-    static void setLuaTraceCallback(LuaTraceCallback* callback);
-
-private:
-    static LuaTraceCallback* traceCallback;
+    /**
+     * the trace callback is stored in the registry of each lua state
+     */
+    static void setLuaTraceCallback(lua_State *L, LuaTraceCallback* callback);
+    static LuaTraceCallback* getLuaTraceCallback(lua_State *L);
 };
 
 
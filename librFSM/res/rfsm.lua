@@ -43,20 +43,33 @@ local coroutine = coroutine
 local pairs = pairs
 local ipairs = ipairs
 local pcall = pcall
+local select = select
 local print = print
 local tostring = tostring
 local string = string
 local type = type
-local loadstring = loadstring
+local loadstring = loadstring or load
 local dofile = dofile
 local assert = assert
 local setmetatable = setmetatable
 local getmetatable = getmetatable
-local unpack = unpack
+local unpack = unpack or table.unpack
 local error = error
 local utils = utils
-
-module("rfsm")
+local _G = _G
+local package = package
+local setfenv = setfenv
+
+-- version neutral module("rfsm"): the module table becomes the
+-- environment of the rest of this chunk (setfenv up to lua 5.1 and
+-- LuaJIT, _ENV since lua 5.2)
+local M = package.loaded.rfsm
+if type(M) ~= 'table' then M = _G.rfsm end
+if type(M) ~= 'table' then M = {} end
+M._NAME, M._M, M._PACKAGE = 'rfsm', M, ''
+_G.rfsm = M
+package.loaded.rfsm = M
+if setfenv then setfenv(1, M) else _ENV = M end
 
 local map = utils.map
 local foreach = utils.foreach
@@ -209,9 +222,11 @@ end
 --- Load fsm from file.
 -- The file must contain an rfsm simple or composite state that is returned.
 -- @param file name of file
+-- @param loader optional function returning the compiled chunk of the file (default dofile)
 -- @return uninitalized fsm.
-function load(file)
-   local fsm = dofile(file)
+function load(file, loader)
+   local fsm
+   if loader then fsm = loader(file)() else fsm = dofile(file) end
    if not is_state(fsm) then
       error("rfsm.load: no valid rfsm in file '" .. tostring(file) .. "' found.")
    end
@@ -418,6 +433,12 @@ local function add_otrs(fsm)
 	  end, fsm, is_trans)
 end
 
+----------------------------------------
+-- precompute the completion events e_done@fqn of the leaf states
+local function add_e_done(fsm)
+   mapfsm(function (s) s._e_done = 'e_done@' .. s._fqn end, fsm, is_leaf)
+end
+
 ----------------------------------------
 -- expand e_done events into e_done@fqn
 local function expand_e_done(fsm)
@@ -485,6 +506,67 @@ function __resolve_path(fsm, state_str, parent)
    return state, mes
 end
 
+-- 1. walk up source path until root
+-- 2. walk up target path until a state is found which is part of the
+--    source path. This state is the LCA.
+local function getLCA(fsm, tr)
+   -- source path lookup table
+   local src_path_lt = {}
+
+   local walker = tr.src._parent
+   while true do
+      src_path_lt[walker] = true
+      if walker == fsm then break end
+      walker = walker._parent
+   end
+
+   walker = tr.tgt._parent
+
+   while not src_path_lt[walker] do
+      walker = walker._parent
+   end
+   return walker
+end
+
+--
+-- compute the implicit paths of transition tr: this is the up path
+-- from tr.src up to (but excluding LCA) and the down path from LCA
+-- (excluded) to tr.tgt
+--
+local function tr_ipath(fsm, tr)
+   local lca = getLCA(fsm, tr)
+   local up_path = {}
+   local down_path = {}
+   local walker
+
+   -- up ...
+   walker = tr.src
+   while walker ~= lca do
+      up_path[#up_path+1] = walker
+      walker = walker._parent
+   end
+
+   -- and down
+   walker = tr.tgt
+   while walker ~= lca do
+      down_path[#down_path+1] = walker
+      walker = walker._parent
+   end
+
+   return lca, up_path, down_path
+end
+
+--
+-- the implicit paths of transition tr are cached in tr._lca,
+-- tr._up_path and tr._down_path: the model is static after init
+--
+local function tr_ipath_cached(fsm, tr)
+   if not tr._lca then
+      tr._lca, tr._up_path, tr._down_path = tr_ipath(fsm, tr)
+   end
+   return tr._lca, tr._up_path, tr._down_path
+end
+
 ----------------------------------------
 -- resolve transition src and target strings into references of the real states
 --    depends on fully qualified names
@@ -537,7 +619,12 @@ local function resolve_trans(fsm)
    end
 
    local function __resolve_trans(tr, parent)
-      return __resolve_src(tr, parent) and __resolve_tgt(tr, parent)
+      if not (__resolve_src(tr, parent) and __resolve_tgt(tr, parent)) then
+	 return false
+      end
+      -- precompute the implicit paths (see exec_trans)
+      if tr.src._parent and tr.tgt._parent then tr_ipath_cached(fsm, tr) end
+      return true
    end
 
    return utils.andt(mapfsm(__resolve_trans, fsm, is_trans))
@@ -663,10 +750,14 @@ local function setup_printers(fsm)
 			    info=utils.stdout, dbg=__null_func } )
 end
 
+-- returned by the default getevents hook (never modified)
+local no_events = {}
+
 --- initialize fsm from rfsm template
 -- @param rfsm template to initialize
+-- @param trusted skip the verification of an already verified template
 -- @return inialized fsm
-function init(fsm_templ)
+function init(fsm_templ, trusted)
 
    assert(is_state(fsm_templ), "invalid fsm model passed to rfsm.init")
 
@@ -679,15 +770,18 @@ function init(fsm_templ)
    add_parent_links(fsm)
    add_ids(fsm)
    add_fqns(fsm)
+   add_e_done(fsm)
    add_defconn(fsm)
 
    -- verify (early)
-   local ret, errs = verify_early(fsm)
+   if not trusted then
+      local ret, errs = verify_early(fsm)
 
-   -- don't fail on warnings
-   if #errs > 0 then
-      fsm.err(table.concat(errs, '\n'))
-      if not ret then return false end
+      -- don't fail on warnings
+      if #errs > 0 then
+	 fsm.err(table.concat(errs, '\n'))
+	 if not ret then return false end
+      end
    end
 
    if not resolve_trans(fsm) then
@@ -696,7 +790,7 @@ function init(fsm_templ)
    end
 
    add_otrs(fsm) -- add outgoing transition table
-   check_no_otrs(fsm)
+   if not trusted then check_no_otrs(fsm) end
    expand_e_done(fsm)
    sort_otrs_pn(fsm)
 
@@ -704,11 +798,13 @@ function init(fsm_templ)
 
    fsm._intq = { 'e_init_fsm' }
    fsm._curq = {}
+   fsm._nsteps = 0
+   fsm._ntrans = 0
 
    -- getevents user hook supplied?
    -- must return a table with events
    if not fsm.getevents then
-      fsm.getevents = function () return {} end
+      fsm.getevents = function () return no_events end
    end
 
    -- run user preproc hooks
@@ -731,9 +827,12 @@ function reset(fsm)
    assert(fsm._initialized, "Can't reset an uninitalized fsm")
    fsm._intq = { 'e_init_fsm' }
    fsm._curq = {}
+   fsm._nsteps = 0
+   fsm._ntrans = 0
    fsm._act_leaf = false
    mapfsm(function (c) c._actchild = nil end, fsm, is_composite)
    mapfsm(function (s) s._doo_co = nil end, fsm, is_leaf)
+   if fsm._exit_hook then fsm._exit_hook(fsm) end
 end
 
 
@@ -746,57 +845,12 @@ end
 function send_events(fsm, ...)
    if not fsm or not is_initialized_root(fsm) then error("ERROR send_events: invalid fsm argument") end
    fsm.dbg("RAISED", ...)
-   for _,v in ipairs({...}) do table.insert(fsm._intq, v) end
-end
-
--- 1. walk up source path until root
--- 2. walk up target path until a state is found which is part of the
---    source path. This state is the LCA.
-local function getLCA(fsm, tr)
-   -- source path lookup table
-   local src_path_lt = {}
-
-   local walker = tr.src._parent
-   while true do
-      src_path_lt[walker] = true
-      if walker == fsm then break end
-      walker = walker._parent
-   end
-
-   walker = tr.tgt._parent
-
-   while not src_path_lt[walker] do
-      walker = walker._parent
-   end
-   return walker
-end
-
---
--- compute the implicit paths of transition tr: this is the up path
--- from tr.src up to (but excluding LCA) and the down path from LCA
--- (excluded) to tr.tgt
---
-local function tr_ipath(fsm, tr)
-   local lca = getLCA(fsm, tr)
-   local up_path = {}
-   local down_path = {}
-   local walker
-
-   -- up ...
-   walker = tr.src
-   while walker ~= lca do
-      up_path[#up_path+1] = walker
-      walker = walker._parent
-   end
-
-   -- and down
-   walker = tr.tgt
-   while walker ~= lca do
-      down_path[#down_path+1] = walker
-      walker = walker._parent
+   local intq = fsm._intq
+   for i=1,select('#', ...) do
+      local v = select(i, ...)
+      if v == nil then break end
+      intq[#intq+1] = v
    end
-
-   return lca, up_path, down_path
 end
 
 ----------------------------------------
@@ -809,10 +863,16 @@ function check_events(fsm)
    return #intq
 end
 
+-- the internal queue and the queue of the previous step are swapped:
+-- both tables (and their array part) are reused across the steps, so
+-- the queue returned is only valid until the next step
 local function get_events(fsm)
    check_events(fsm)
    local ret = fsm._intq
-   fsm._intq = {}
+   local intq = fsm._curq
+   for i=#intq,1,-1 do intq[i] = nil end
+   fsm._intq = intq
+   fsm._curq = ret
    return ret
 end
 
@@ -890,7 +950,7 @@ local function run_doos(fsm)
 	       doo_done = true
 	       state._doo_co = nil
 	       set_sta_mode(state, 'done')
-	       send_events(fsm, "e_done@" .. state._fqn)
+	       send_events(fsm, state._e_done or "e_done@" .. state._fqn)
 	       fsm.dbg("DOO", "removing completed coroutine of " .. state._fqn .. " doo")
 	    end
 	 end
@@ -907,6 +967,7 @@ local function enter_one_state(fsm, state, hot)
 
    if not is_state(state) then return end
    set_sta_mode(state, 'active')
+   if fsm._enter_hook then fsm._enter_hook(state) end
    if state.entry then
       local succ, err = pcall(state.entry, fsm, state, 'entry')
       if not succ then
@@ -919,7 +980,7 @@ local function enter_one_state(fsm, state, hot)
       fsm._act_leaf = state
       if not state.doo then
 	 set_sta_mode(state, 'done')
-	 send_events(fsm, "e_done@" .. state._fqn)
+	 send_events(fsm, state._e_done or "e_done@" .. state._fqn)
       else -- is there an old coroutine lingering?
 	 if not hot and state._doo_co then state._doo_co = nil end
       end
@@ -945,6 +1006,7 @@ function exit_state(fsm, state)
       state._parent._last_active_mode = get_sta_mode(state)
 
       set_sta_mode(state, 'inactive')
+      if fsm._exit_hook then fsm._exit_hook(state) end
 
       if state.exit then
 	 local succ, err = pcall(state.exit, fsm, state, 'exit')
@@ -1016,7 +1078,7 @@ local function __exec_trans_exit(fsm, tr, lca, up_path)
 end
 
 local function exec_trans_exit(fsm, tr)
-   local lca, up_path, down_path = tr_ipath(fsm, tr)
+   local lca, up_path, down_path = tr_ipath_cached(fsm, tr)
    __exec_trans_exit(fsm, tr, lca, up_path)
 end
 
@@ -1041,14 +1103,14 @@ local function __exec_trans_enter(fsm, tr, lca, down_path)
    assert(#down_path >= 1)
    fsm.dbg("TRANS_ENTER", "lca: " .. lca._fqn, "down_path: ",
 	   table.concat(map(function (s) return s._fqn end, down_path), " > "))
-   -- now enter down_path
-   while #down_path > 0 do
-      enter_one_state(fsm, table.remove(down_path))
+   -- now enter down_path (cached, thus not consumed)
+   for i=#down_path,1,-1 do
+      enter_one_state(fsm, down_path[i])
    end
 end
 
 local function exec_trans_enter(fsm, tr)
-   local lca, up_path, down_path = tr_ipath(fsm, tr)
+   local lca, up_path, down_path = tr_ipath_cached(fsm, tr)
    __exec_trans_enter(fsm, tr, lca, down_path)
 end
 
@@ -1056,7 +1118,7 @@ end
 -- can't fail in any way
 --
 local function exec_trans(fsm, tr)
-   local lca, up_path, down_path = tr_ipath(fsm, tr)
+   local lca, up_path, down_path = tr_ipath_cached(fsm, tr)
    __exec_trans_exit(fsm, tr, lca, up_path)
    exec_trans_effect(fsm, tr)
    __exec_trans_enter(fsm, tr, lca, down_path)
@@ -1146,6 +1208,7 @@ local function exec_path(fsm, path)
    end
 
    fsm.dbg("EXEC_PATH", path2str(path))
+   fsm._ntrans = fsm._ntrans + 1
    return __exec_path(path)
 end
 
@@ -1198,7 +1261,7 @@ end
 function node_find_enabled(fsm, start, events)
 
    -- find a path starting from node
-   function __find_path(nde, events)
+   local function __find_path(nde, events)
       local cur = { node=nde, nextl={} }
 
       -- path ends if no outgoing path. The static validation should
@@ -1233,10 +1296,14 @@ end
 local function fsm_find_enabled(fsm, events)
    local depth = 0
 
+   -- native search installed by the host on precompiled dispatch
+   -- tables (it does not call the guards of untriggered transitions)
+   if fsm._find_enabled then return fsm._find_enabled(fsm, events) end
+
    -- states is table of active states at a certain depth
    local function __find_enabled(state)
       fsm.dbg("CHECKING", "depth:", depth, "for transitions from " .. state._fqn)
-      path = node_find_enabled(fsm, state, events)
+      local path = node_find_enabled(fsm, state, events)
       if path then return path end
       local next = actchild_get(state)
       if not next then return end
@@ -1265,7 +1332,9 @@ end
 ----------------------------------------
 -- enter fsm for the first time
 local function enter_fsm(fsm, events)
-   local path = node_find_enabled(fsm, fsm.initial, events)
+   local path
+   if fsm._find_enabled then path = fsm._find_enabled(fsm, events, fsm.initial)
+   else path = node_find_enabled(fsm, fsm.initial, events) end
 
    if path == false then
       fsm._mode = 'inactive'
@@ -1337,7 +1406,10 @@ function step(fsm, n)
    if fsm.post_step_hook then fsm.post_step_hook(fsm, curq) end
 
    -- do not dec if no transition executed.
-   if do_dec then n = n - 1 end
+   if do_dec then
+      n = n - 1
+      fsm._nsteps = fsm._nsteps + 1
+   end
 
    if n < 1 then
       return idle
@@ -4,9 +4,18 @@
 --
 
 local type, pairs, ipairs, setmetatable, getmetatable, assert, table, print, tostring, string, io, unpack, error =
-   type, pairs, ipairs, setmetatable, getmetatable, assert, table, print, tostring, string, io, unpack, error
-
-module('utils')
+   type, pairs, ipairs, setmetatable, getmetatable, assert, table, print, tostring, string, io, unpack or table.unpack, error
+local loadstring = loadstring or load
+local _G, package, setfenv = _G, package, setfenv
+
+-- version neutral module('utils') (see rfsm.lua)
+local M = package.loaded.utils
+if type(M) ~= 'table' then M = _G.utils end
+if type(M) ~= 'table' then M = {} end
+M._NAME, M._M, M._PACKAGE = 'utils', M, ''
+_G.utils = M
+package.loaded.utils = M
+if setfenv then setfenv(1, M) else _ENV = M end
 
 -- increment major on API breaks
 -- increment minor on non breaking changes
@@ -184,7 +193,7 @@ end
 
 function cdr(tab)
    local new_array = {}
-   for i = 2, table.getn(tab) do
+   for i = 2, #tab do
       table.insert(new_array, tab[i])
    end
    return new_array
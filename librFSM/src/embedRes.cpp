@@ -1,5 +1,10 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <lua.hpp>
+#include <rfsmUtils.h>
+
+#define DEBUG_CALL "fsm.dbg("
 
 FILE* open_or_exit(const char* fname, const char* mode)
 {
@@ -11,15 +16,136 @@ FILE* open_or_exit(const char* fname, const char* mode)
   return f;
 }
 
+char* read_or_exit(FILE* in, size_t* len)
+{
+  size_t size = 4096;
+  char* data = (char*) malloc(size);
+  *len = 0;
+  while (data != NULL) {
+    *len += fread(data + *len, 1, size - *len, in);
+    if (*len < size)
+      return data;
+    size *= 2;
+    data = (char*) realloc(data, size);
+  }
+  perror("embedRes");
+  exit(EXIT_FAILURE);
+}
+
+/*
+ * Blanks the fsm.dbg(...) statements of a lua source (the ones starting
+ * a line) up to their closing parenthesis. The newlines are kept so that
+ * the line numbers of the error messages do not change.
+ */
+void strip_debug(char* data, size_t len)
+{
+  size_t call = strlen(DEBUG_CALL);
+  int line_start = 1;
+  size_t i;
+  for (i=0; i < len; i++) {
+    if (data[i] == '\n') { line_start = 1; continue; }
+    if (data[i] == ' ' || data[i] == '\t') continue;
+    if (line_start && i + call <= len && strncmp(data + i, DEBUG_CALL, call) == 0) {
+      int depth = 0;
+      char quote = 0;
+      for (; i < len; i++) {
+        char c = data[i];
+        if (quote) {
+          if (c == '\\' && i + 1 < len && data[i+1] != '\n') data[i++] = ' ';
+          else if (c == quote) quote = 0;
+        }
+        else if (c == '"' || c == '\'') quote = c;
+        else if (c == '(') depth++;
+        else if (c == ')' && --depth == 0) { data[i] = ' '; break; }
+        if (c != '\n') data[i] = ' ';
+      }
+    }
+    line_start = 0;
+  }
+}
+
+struct buffer {
+  char* data;
+  size_t len;
+};
+
+int write_buffer(lua_State* L, const void* p, size_t size, void* ud)
+{
+  struct buffer* b = (struct buffer*) ud;
+  char* data = (char*) realloc(b->data, b->len + size);
+  if (data == NULL)
+    return 1;
+  memcpy(data + b->len, p, size);
+  b->data = data;
+  b->len += size;
+  return 0;
+}
+
+/*
+ * Compiles the lua source into bytecode (with its debug information,
+ * for the tracebacks). The bytecode can be loaded only by the same
+ * lua version.
+ */
+void compile_or_exit(const char* name, char** data, size_t* len)
+{
+  lua_State* L = luaL_newstate();
+  if (L == NULL || luaL_loadbuffer(L, *data, *len, name) != 0) {
+    fprintf(stderr, "%s: %s\n", name, (L) ? lua_tostring(L, -1) : "cannot create the lua state");
+    exit(EXIT_FAILURE);
+  }
+  struct buffer b = { NULL, 0 };
+#if LUA_VERSION_NUM >= 503
+  int status = lua_dump(L, write_buffer, &b, 0);
+#else
+  int status = lua_dump(L, write_buffer, &b);
+#endif
+  lua_close(L);
+  if (status != 0 || b.data == NULL) {
+    fprintf(stderr, "%s: cannot dump the bytecode\n", name);
+    exit(EXIT_FAILURE);
+  }
+  free(*data);
+  *data = b.data;
+  *len = b.len;
+}
+
 int main(int argc, char** argv)
 {
-  if (argc < 3) {
-    fprintf(stderr, "USAGE: %s {sym} {rsrc}\n\n  Creates {sym}.c from the contents of {rsrc}\n", argv[0]);
+  int strip = 0, compile = 0, auxiliary = 0;
+  while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+    if (strcmp(argv[1], "--strip-debug") == 0) strip = 1;
+    else if (strcmp(argv[1], "--compile") == 0) compile = 1;
+    else if (strcmp(argv[1], "--auxiliary") == 0) auxiliary = 1;
+    else break;
+    argc--; argv++;
+  }
+
+  if (argc < (auxiliary ? 2 : 3)) {
+    fprintf(stderr, "USAGE: %s [--strip-debug] [--compile] [--auxiliary] {sym} {rsrc}\n\n  Creates {sym}.c from the contents of {rsrc}\n"
+            "  --strip-debug removes the fsm.dbg() calls from the lua source\n"
+            "  --compile embeds the lua bytecode instead of the source\n"
+            "  --auxiliary embeds the auxiliary functions of librFSM (no {rsrc})\n", argv[0]);
     return EXIT_FAILURE;
   }
 
   const char* sym = argv[1];
-  FILE* in = open_or_exit(argv[2], "r");
+  FILE* in = NULL;
+  size_t len = 0;
+  char* data = NULL;
+  if (auxiliary) {
+    len = strlen(RFSM_AUXILIARY_CHUNK);
+    data = (char*) malloc(len);
+    if (data == NULL) { perror("embedRes"); return EXIT_FAILURE; }
+    memcpy(data, RFSM_AUXILIARY_CHUNK, len);
+  }
+  else {
+    in = open_or_exit(argv[2], "rb");
+    data = read_or_exit(in, &len);
+  }
+  if (strip)
+    strip_debug(data, len);
+  if (compile)
+    compile_or_exit(auxiliary ? "RFSM_AUXILIARY_CHUNK" : sym, &data, &len);
 
   char symfile[256];
 #ifdef WIN32
@@ -32,23 +158,20 @@ int main(int argc, char** argv)
   fprintf(out, "#include <stdlib.h>\n");
   fprintf(out, "const char %s[] = {\n", sym);
 
-  unsigned char buf[256];
-  size_t nread = 0;
   size_t linecount = 0;
-  do {
-    nread = fread(buf, 1, sizeof(buf), in);
-    size_t i;
-    for (i=0; i < nread; i++) {
-      fprintf(out, "0x%02x, ", buf[i]);
-      if (++linecount == 10) { fprintf(out, "\n"); linecount = 0; }
-    }
-  } while (nread > 0);
+  size_t i;
+  for (i=0; i < len; i++) {
+    fprintf(out, "0x%02x, ", (unsigned char) data[i]);
+    if (++linecount == 10) { fprintf(out, "\n"); linecount = 0; }
+  }
   fprintf(out, "0x%02x, ", 0);
   if (linecount > 0) fprintf(out, "\n");
   fprintf(out, "};\n");
   fprintf(out, "const size_t %s_len = sizeof(%s);\n\n",sym,sym);
 
-  fclose(in);
+  free(data);
+  if (in)
+    fclose(in);
   fclose(out);
 
   return EXIT_SUCCESS;
@@ -4,12 +4,18 @@
  * CopyPolicy: Released under the terms of the LGPLv2.1 or later, see LGPL.TXT
  */
 
+#include <math.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <algorithm>
+#include <fstream>
 #include <sstream>
+#include <unordered_map>
 #include <rfsmUtils.h>
+#include <rfsmEventQueue.h>
 #include <rfsm.h>
 
 #include <lua.hpp>
@@ -20,8 +26,15 @@ using namespace rfsm;
 #define CHECK_LUA_INITIALIZED(L) if(!L) { yError()<<"Lua has not been initialized. call StateMachine::load()"<<ENDL; return false; }
 
 #ifdef WITH_EMBEDDED_RFSM
+// the embedded resources (lua source or bytecode) followed by a '\0'
 extern "C" const char gen_rfsm_res[];
+extern "C" const size_t gen_rfsm_res_len;
+extern "C" const char gen_rfsm_release_res[];
+extern "C" const size_t gen_rfsm_release_res_len;
 extern "C" const char gen_rfsm_utils_res[];
+extern "C" const size_t gen_rfsm_utils_res_len;
+extern "C" const char gen_rfsm_aux_res[];
+extern "C" const size_t gen_rfsm_aux_res_len;
 #endif
 
 
@@ -31,32 +44,160 @@ void StateGraph::clear() {
     transitions.clear();
 }
 
+namespace {
+
+// an outgoing transition compiled at load: the indices of the transition and
+// of its target in the tables of fsm._find_enabled and the bitset of the events
+// which trigger it
+struct DispatchTransition {
+    int trans;
+    int target;
+    int kind;
+    bool eventless;
+    std::vector<uint64_t> events;
+};
+
+// the outgoing transitions of a node in the order of node._otrs (by pn)
+// and the union of their events
+struct DispatchNode {
+    DispatchNode() : eventless(false) { }
+    std::vector<DispatchTransition> transitions;
+    std::vector<uint64_t> events;
+    bool eventless;
+};
+
+// the lua engine which compiles the chunks of the model cache
+#ifdef LUAJIT_VERSION
+    #define MODEL_CACHE_ENGINE  LUAJIT_VERSION
+#else
+    #define MODEL_CACHE_ENGINE  LUA_RELEASE
+#endif
+
+// the 64-bit FNV-1a hash of a buffer
+uint64_t hashBuffer(const void* data, size_t size, uint64_t hash=14695981039346656037ULL) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for(size_t i=0; i<size; i++)
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    return hash;
+}
+
+// the seed of the cache keys: the bytecode depends on the engine and on its word size
+uint64_t engineHash() {
+    unsigned char wordSize = sizeof(void*);
+    return hashBuffer(&wordSize, 1, hashBuffer(MODEL_CACHE_ENGINE, strlen(MODEL_CACHE_ENGINE)));
+}
+
+bool fileExists(const std::string& path) {
+    std::ifstream file(path.c_str(), std::ios::binary);
+    return file.good();
+}
+
+bool readFile(const std::string& path, std::string& content) {
+    std::ifstream file(path.c_str(), std::ios::binary);
+    if(!file)
+        return false;
+    std::ostringstream buffer;
+    buffer<<file.rdbuf();
+    content = buffer.str();
+    return true;
+}
+
+// writes a temporary file and renames it, so that the other processes
+// sharing the cache never read a partial file
+bool writeFile(const std::string& path, const std::string& content) {
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".%llx.tmp",
+             (unsigned long long) std::chrono::steady_clock::now().time_since_epoch().count());
+    std::string temporary = path + suffix;
+    {
+        std::ofstream file(temporary.c_str(), std::ios::binary);
+        if(!file.write(content.data(), content.size()))
+            return false;
+    }
+    if(rename(temporary.c_str(), path.c_str()) != 0) {
+        remove(temporary.c_str());
+        return fileExists(path);
+    }
+    return true;
+}
+
+int writeChunk(lua_State* L, const void* data, size_t size, void* ud) {
+    static_cast<std::string*>(ud)->append(static_cast<const char*>(data), size);
+    return 0;
+}
+
+}
+
 class StateMachine::Private {
 public:
-	Private() : L(NULL) { } 
-	virtual ~Private() { }
+	Private() : L(NULL), sharedState(false), trace(NULL), host(NULL), nextGuest(0), footprint(0), graphLoaded(false),
+        tracebackRef(LUA_NOREF), fsmRef(LUA_NOREF),
+        sendEventsRef(LUA_NOREF), sendEventRef(LUA_NOREF), stepRef(LUA_NOREF), runRef(LUA_NOREF),
+        pushEventsRef(LUA_NOREF), pushEventIdsRef(LUA_NOREF), eventsRef(LUA_NOREF),
+        stepMachineRef(LUA_NOREF), statesRef(LUA_NOREF), runMachineRef(LUA_NOREF), postedEvents(NULL), postQueueSize(256), activeLeaf(-1),
+        allocator(NULL), memoryLimit(0), gcMode(GCIncremental), realTimeGC(false), eventWords(0),
+        instrumented(false), trustedCache(false), cacheKey(0) { }
+	virtual ~Private() { delete postedEvents; }
 
     static int entryCallback(lua_State* L);
     static int dooCallback(lua_State* L);
     static int exitCallback(lua_State* L);
+    static int guardCallback(lua_State* L);
+    static int effectCallback(lua_State* L);
     static int preStepCallback(lua_State* L);
     static int postStepCallback(lua_State* L);
     static int warningCallback(lua_State* L);
     static int infoCallback(lua_State* L);
     static int errorCallback(lua_State* L);
     static int luaPrint(lua_State* L);
-
-    static bool getLuaFuncStringParam(lua_State* L,
-                                      StateMachine* &owner, std::string& strParam);
-
+    static int pushEvents(lua_State* L);
+    static int pushEventIds(lua_State* L);
+    static int sendEventString(lua_State* L);
+    static int getEvents(lua_State* L);
+    static int enterHook(lua_State* L);
+    static int exitHook(lua_State* L);
+    static int findEnabled(lua_State* L);
+    static int cachedLoadfile(lua_State* L);
+    static bool checkGuard(lua_State* L, int tr);
+    static int stepMachine(lua_State* L);
+    static int runMachine(lua_State* L);
+
+    static std::string packArgs(lua_State* L, const char* separator, bool trailing);
+    static void* allocate(void* ud, void* ptr, size_t osize, size_t nsize);
+    static int panic(lua_State* L);
+
+    bool openState(rfsm::LuaTraceCallback* callback);
+    bool applyGCMode();
+    bool initModel(StateMachine* owner, bool verbose, bool trusted=false);
     bool getAllEvents();
     bool getAllStateGraph();
+    const rfsm::StateGraph& stateGraph();
     bool registerAuxiliaryFunctions();
-    bool registerCFunction(const std::string& name, lua_CFunction func, bool global=false);
-    void callEntryCallback(const std::string& state);
-    void callDooCallback(const std::string& state);
-    void callExitCallback(const std::string& state);
+    void setPrinter(int table, const char* name, lua_CFunction func, StateMachine* owner);
+    void setPrinters(int table, StateMachine* owner, bool verbose);
+    bool addStepHook(const char* adder, lua_CFunction func, StateMachine* owner);
+    bool bindStateCallback(StateId state, rfsm::StateCallback* callback);
     bool isrFSMLoaded();
+    bool isKnownEvent(const char* event);
+    bool resolveReferences();
+    bool attach(StateMachine* owner);
+    bool registerGetEvents();
+    bool indexStates();
+    bool registerStateHooks(StateMachine* owner);
+    bool registerFindEnabled();
+    bool registerModelCache();
+    size_t usedMemory();
+    std::string cachePath(uint64_t key, const char* extension);
+    void setQueuedEvents(lua_State* L, int events);
+    bool isTriggered(const std::vector<uint64_t>& events);
+    bool findPath(lua_State* L, int node, int start);
+    static int getStateId(lua_State* L, Private* priv);
+    int getFunctionRef(const char* table, const char* name);
+    int pcall(int narg, int nresults);
+    template<typename Body> bool protect(Body body);
+    bool step(const char* event, EventId id, lua_Number n, StepResult* result);
+    void resetStepCounters(int fsm);
+    void getStepResult(int fsm, StepResult& result);
     //typedef int (rfsm::StateMachine::* LuaRfsmCallback) (lua_State *L);
     //bool registerLuaFunction(const std::string& name, LuaRfsmCallback func);
 
@@ -64,18 +205,110 @@ public:
 
 public:
     lua_State *L;
-    std::vector<luaL_reg> luaFuncReg;
+    // the lua state belongs to a StateMachineTemplate and
+    // its errors are reported to trace
+    bool sharedState;
+    rfsm::LuaTraceCallback* trace;
+    // the StateMachineHost or StateMachineTemplate of this machine and
+    // the machines hosted or instantiated by this one
+    Private* host;
+    std::vector<Private*> guests;
+    size_t nextGuest;
+    size_t footprint;
     std::string fileName;
     std::string luaPackagePath;
     std::vector<std::string> events;
+    std::unordered_map<EventHash, EventId> eventIndex;
+    // the state graph is extracted at the first stateGraph()
     rfsm::StateGraph graph;
-    std::map<std::string, rfsm::StateCallback*> callbacks;
+    bool graphLoaded;
+    // registry references resolved once at load()
+    int tracebackRef;
+    int fsmRef;
+    int sendEventsRef;
+    int sendEventRef;
+    int stepRef;
+    int runRef;
+    int pushEventsRef;
+    int pushEventIdsRef;
+    // table of the event names indexed by EventId+1
+    int eventsRef;
+    int stepMachineRef;
+    // table of the state tables indexed by StateId+1
+    int statesRef;
+    int runMachineRef;
+    // events posted from other threads, drained by fsm.getevents
+    rfsm::ConcurrentEventQueue* postedEvents;
+    size_t postQueueSize;
+    std::string postedEvent;
+    // states indexed by their _cid and the active configuration
+    // (from the outermost state to the leaf) updated by the enter/exit hooks
+    std::vector<std::string> stateNames;
+    std::unordered_map<std::string, StateId> stateIndex;
+    std::vector<size_t> stateDepth;
+    std::vector<bool> stateLeaf;
+    std::vector<int> activeChain;
+    int activeLeaf;
+    // the allocator of the lua state (NULL is realloc) and its accounting
+    rfsm::Allocator* allocator;
+    size_t memoryLimit;
+    rfsm::MemoryStats memory;
+    rfsm::GCMode gcMode;
+    bool realTimeGC;
+    rfsm::GCStats gcStats;
+    // the dispatch tables indexed by the node ids of fsm._find_enabled
+    // and the bitset of the events of the current step
+    std::vector<DispatchNode> dispatch;
+    size_t eventWords;
+    std::vector<uint64_t> queuedEvents;
+    // the events passed to TransitionCallback::guard()
+    std::vector<EventId> guardEvents;
+    // loads the embedded rfsm engine with the fsm.dbg() calls
+    bool instrumented;
+    // the directory of the compiled model cache (empty if it is disabled)
+    // and the hash of the files loaded through it by load()
+    std::string cacheDirectory;
+    bool trustedCache;
+    uint64_t cacheKey;
 };
 
 
+namespace {
+
+// the light userdata of the trampoline of StateMachine::Private::protect()
+template<typename Body>
+struct ProtectedBody {
+    ProtectedBody(Body& body) : body(body), result(false) { }
+    static int call(lua_State* L) {
+        ProtectedBody* self = static_cast<ProtectedBody*>(lua_touserdata(L, 1));
+        lua_settop(L, 0);
+        self->result = self->body();
+        return 0;
+    }
+    Body& body;
+    bool result;
+};
+
+}
+
+/**
+ * runs body() in protected mode and returns its result. The errors raised
+ * by the lua API calls of the body (e.g. an allocation refused by the memory
+ * limit) are reported and make it return false instead of reaching panic().
+ * The stack is left as it was.
+ */
+template<typename Body>
+bool StateMachine::Private::protect(Body body) {
+    int top = lua_gettop(L);
+    ProtectedBody<Body> call(body);
+    int status = Utils::report(L, Utils::cpcall(L, ProtectedBody<Body>::call, &call), trace);
+    lua_settop(L, top);
+    return (status == LUA_OK) && call.result;
+}
+
+
 StateMachine::StateMachine(bool verbose):  mPriv(new Private()) {	
     StateMachine::verbose = verbose;
-    Utils::setLuaTraceCallback((rfsm::LuaTraceCallback*) this);
 }
 
 StateMachine::~StateMachine() {	
@@ -91,435 +324,1009 @@ const std::string StateMachine::getFileName() {
     return mPriv->fileName;
 }
 
-bool StateMachine::load(const std::string& filename) {   
+bool StateMachine::load(const std::string& filename, bool extractGraph) {   
     close();
     mPriv->fileName = filename;
-    // initiate lua state
-    mPriv->L = luaL_newstate();
-    if(mPriv->L==NULL) {
-        yError()<<"Cannot initialize lua! (luaL_newstate)"<<ENDL;
+    // initiate lua state and load the rfsm package.
+    // lua errors of this state are reported to onTrace()
+    if(!mPriv->openState((rfsm::LuaTraceCallback*) this)) {
+        close();
         return false;
     }
 
-    luaL_openlibs(mPriv->L);
+    bool cached = !mPriv->cacheDirectory.empty();
+    string cmd = "fsm_model = rfsm.load('"+filename+"'" + (cached ? ", rfsm_cached_loadfile)" : ")");
+    string verified;
+    bool trusted = false;
+    bool loaded = mPriv->protect([&]() -> bool {
+        // loading rfsm state machine (through the model cache if it is enabled)
+        if(cached && !mPriv->registerModelCache())
+            return false;
+        if(Utils::dostring(mPriv->L, cmd.c_str(), "fsm_model", !mPriv->realTimeGC) != LUA_OK)
+            return false;
 
-    // setting user-defined lua package paths
-    if(mPriv->luaPackagePath.size()) {
-        string command = "package.path=package.path .. '" + mPriv->luaPackagePath + "'";
-        if(Utils::dostring(mPriv->L, command.c_str(), "command") != LUA_OK)
-            yWarning()<<"Could not set lua package path from"<<mPriv->luaPackagePath<<ENDL;
-    }
+        // a model whose files have been already verified is not verified again
+        // in trusted mode
+        if(cached) {
+            verified = mPriv->cachePath(mPriv->cacheKey, ".verified");
+            trusted = mPriv->trustedCache && fileExists(verified);
+        }
 
-    // loading rfsm package
-#ifdef WITH_EMBEDDED_RFSM
-    if(Utils::dostring(mPriv->L, gen_rfsm_utils_res, "gen_rfsm_utils_res") != LUA_OK)
-        return false;
-    if(Utils::dostring(mPriv->L, gen_rfsm_res, "gen_rfsm_res") != LUA_OK)
-        return false;
-#else
-    if (Utils::dolibrary(mPriv->L, "rfsm") != LUA_OK) {
+        // initializing rfsm state machine
+        lua_getglobal(mPriv->L, "fsm_model");
+        if(!mPriv->initModel(this, verbose, trusted))
+            return false;
+
+        // the initialized fsm is available to doString() as fsm
+        lua_rawgeti(mPriv->L, LUA_REGISTRYINDEX, mPriv->fsmRef);
+        lua_setglobal(mPriv->L, "fsm");
+        return true;
+    });
+    if(!loaded) {
         close();
         return false;
     }
-#endif
+    if(cached && !trusted && !writeFile(verified, ""))
+        yWarning()<<"Cannot write"<<verified<<ENDL;
+    if(extractGraph)
+        mPriv->stateGraph();
+
+    // the garbage of the loading is left to collectGarbage() in real-time mode
+    if(mPriv->realTimeGC)
+        lua_gc(mPriv->L, LUA_GCSTOP, 0);
+    return true;
+}
 
-    // registering some utility fuctions in lua
-    lua_pushlightuserdata(mPriv->L, this);
-    lua_setglobal(mPriv->L, "RFSM_Owner");
-    if(!mPriv->registerAuxiliaryFunctions())
+bool StateMachine::run() {
+    if(!mPriv->isrFSMLoaded())
         return false;
+    lua_rawgeti(mPriv->L, LUA_REGISTRYINDEX, mPriv->runRef);
+    lua_rawgeti(mPriv->L, LUA_REGISTRYINDEX, mPriv->fsmRef);
+    return (mPriv->pcall(1, 0) == LUA_OK);
+}
 
-    // loading rfsm state machine
-    string cmd = "fsm_model = rfsm.load('"+filename+"')";
-    if(Utils::dostring(mPriv->L, cmd.c_str(), "fsm_model") != LUA_OK) {
-        close();
+bool StateMachine::step(unsigned int n) {
+    if(!mPriv->isrFSMLoaded())
         return false;
-    }
+    lua_rawgeti(mPriv->L, LUA_REGISTRYINDEX, mPriv->stepRef);
+    lua_rawgeti(mPriv->L, LUA_REGISTRYINDEX, mPriv->fsmRef);
+    lua_pushinteger(mPriv->L, n);
+    return (mPriv->pcall(2, 0) == LUA_OK);
+}
 
-    // setting verbosity mode
-    if(!verbose) {
-        doString("fsm_model.warn = rfsm_null_func");
-        doString("fsm_model.info = rfsm_null_func");
-    }
-    else {
-        doString("fsm_model.warn = rfsm_warning");
-        doString("fsm_model.info = rfsm_info");
-    }
-    doString("fsm_model.err = rfsm_error");
+bool StateMachine::run(StepResult& result) {
+    result = StepResult();
+    if(!mPriv->isrFSMLoaded())
+        return false;
+    return mPriv->step(NULL, InvalidEventId, HUGE_VAL, &result);
+}
 
-    // initializing rfsm state machine
-    if(Utils::dostring(mPriv->L, "fsm = rfsm.init(fsm_model)", "fsm") != LUA_OK) {
-        close();
+bool StateMachine::step(unsigned int n, StepResult& result) {
+    result = StepResult();
+    if(!mPriv->isrFSMLoaded())
         return false;
-    }
+    return mPriv->step(NULL, InvalidEventId, n, &result);
+}
 
-    // getting all availabe events and state graph
-    if(!mPriv->getAllEvents())
-        yWarning()<<"Cannot retrieve all events"<<ENDL;
-    if(!mPriv->getAllStateGraph())
-        yWarning()<<"Cannot retrieve state graph"<<ENDL;
+bool StateMachine::runFor(unsigned int maxSteps, std::chrono::nanoseconds budget, StepResult& result) {
+    result = StepResult();
+    if(!mPriv->isrFSMLoaded())
+        return false;
+    const std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + budget;
+    lua_rawgeti(mPriv->L, LUA_REGISTRYINDEX, mPriv->runMachineRef);
+    lua_pushlightuserdata(mPriv->L, mPriv);
+    lua_pushlightuserdata(mPriv->L, &result);
+    lua_pushnumber(mPriv->L, maxSteps);
+    lua_pushlightuserdata(mPriv->L, (void*) &deadline);
+    return (mPriv->pcall(4, 0) == LUA_OK);
+}
 
-    return true;
+bool StateMachine::sendAndStep(const std::string& event, unsigned int n) {
+    if(!mPriv->isrFSMLoaded())
+        return false;
+    if(!mPriv->isKnownEvent(event.c_str()))
+        yWarning()<<"Sending the undefined event"<<event<<ENDL;
+    return mPriv->step(event.c_str(), InvalidEventId, n, NULL);
 }
 
-bool StateMachine::run() {
+bool StateMachine::sendAndStep(const std::string& event, unsigned int n, StepResult& result) {
+    result = StepResult();
     if(!mPriv->isrFSMLoaded())
         return false;
-    return (Utils::dostring(mPriv->L, "rfsm.run(fsm)", "run") == LUA_OK);
+    if(!mPriv->isKnownEvent(event.c_str()))
+        yWarning()<<"Sending the undefined event"<<event<<ENDL;
+    return mPriv->step(event.c_str(), InvalidEventId, n, &result);
 }
 
-bool StateMachine::step(unsigned int n) {
+bool StateMachine::sendAndStep(EventId event, unsigned int n) {
     if(!mPriv->isrFSMLoaded())
         return false;
-    char command[128];
-#ifdef WIN32
-    _snprintf(command, 128, "rfsm.step(fsm, %d)", n);
-#else
-	snprintf(command, 128, "rfsm.step(fsm, %d)", n);
-#endif
-    return (Utils::dostring(mPriv->L, command, "step") == LUA_OK);
+    if(event < 0 || event >= (EventId) mPriv->events.size()) {
+        yError()<<"StateMachine::sendAndStep() got an invalid event id"<<event<<ENDL;
+        return false;
+    }
+    return mPriv->step(NULL, event, n, NULL);
+}
+
+bool StateMachine::sendAndStep(EventId event, unsigned int n, StepResult& result) {
+    result = StepResult();
+    if(!mPriv->isrFSMLoaded())
+        return false;
+    if(event < 0 || event >= (EventId) mPriv->events.size()) {
+        yError()<<"StateMachine::sendAndStep() got an invalid event id"<<event<<ENDL;
+        return false;
+    }
+    return mPriv->step(NULL, event, n, &result);
 }
 
 bool StateMachine::sendEvent(const std::string& event) {
     if(!mPriv->isrFSMLoaded())
         return false;
-    if(std::find(mPriv->events.begin(), mPriv->events.end(), event) == mPriv->events.end())
+    if(!mPriv->isKnownEvent(event.c_str()))
         yWarning()<<"Sending the undefined event"<<event<<ENDL;
-    string command = "rfsm.send_events(fsm, '"+event+"')";
-    return (Utils::dostring(mPriv->L, command.c_str(), "sendEvent") == LUA_OK);
+    lua_rawgeti(mPriv->L, LUA_REGISTRYINDEX, mPriv->sendEventRef);
+    lua_pushlightuserdata(mPriv->L, mPriv);
+    lua_pushlightuserdata(mPriv->L, (void*) &event);
+    return (mPriv->pcall(2, 0) == LUA_OK);
 }
 
-bool StateMachine::sendEvents(unsigned int n, ...) {
+bool StateMachine::sendEvent(EventId event) {
     if(!mPriv->isrFSMLoaded())
         return false;
-    register unsigned int i;
+    if(event < 0 || event >= (EventId) mPriv->events.size()) {
+        yError()<<"StateMachine::sendEvent() got an invalid event id"<<event<<ENDL;
+        return false;
+    }
+    lua_rawgeti(mPriv->L, LUA_REGISTRYINDEX, mPriv->sendEventsRef);
+    lua_rawgeti(mPriv->L, LUA_REGISTRYINDEX, mPriv->fsmRef);
+    lua_rawgeti(mPriv->L, LUA_REGISTRYINDEX, mPriv->eventsRef);
+    lua_rawgeti(mPriv->L, -1, event + 1);
+    lua_remove(mPriv->L, -2);
+    return (mPriv->pcall(2, 0) == LUA_OK);
+}
+
+bool StateMachine::sendEvents(unsigned int n, ...) {
+    std::vector<const char*> events;
     va_list ap;
     va_start(ap, n);
-    const char* event = va_arg(ap, char*);
-    yAssert(event != NULL);
-    string command = string("rfsm.send_events(fsm, '") + event + "'";
-    for(i=2; i<= n; i++) {
-        event = va_arg(ap, const char*);
+    for(unsigned int i=0; i<n; i++) {
+        const char* event = va_arg(ap, const char*);
         yAssert(event != NULL);
-        if(std::find(mPriv->events.begin(), mPriv->events.end(), event) == mPriv->events.end())
-            yWarning()<<"Sending the undefined event"<<event<<ENDL;
-        command += string(", '") + event + string("'");
+        events.push_back(event);
     }
     va_end(ap);
-    command += ")";
-    return (Utils::dostring(mPriv->L, command.c_str(), "sendEvents") == LUA_OK);
+    return sendEventList(events);
 }
 
-
-const std::vector<std::string>& StateMachine::getEventsList() {
-    return mPriv->events;
+bool StateMachine::sendEvents(const std::vector<std::string>& events) {
+    return sendEvents(events.begin(), events.end());
 }
 
-bool StateMachine::getEventQueue(std::vector<std::string>& equeue) {
+bool StateMachine::sendEvents(const std::vector<EventId>& events) {
     if(!mPriv->isrFSMLoaded())
         return false;
-    equeue.clear();
-    lua_getglobal(mPriv->L, "rfsm_get_event_queue");
-    if(!lua_isfunction(mPriv->L, -1)) {
-        yError()<<"StateMachine::getEventQueue() could not find rfsm_get_event_queue()"<<ENDL;
-        return false;
+    for(size_t i=0; i<events.size(); i++) {
+        if(events[i] < 0 || events[i] >= (EventId) mPriv->events.size()) {
+            yError()<<"StateMachine::sendEvents() got an invalid event id"<<events[i]<<ENDL;
+            return false;
+        }
     }
+    lua_rawgeti(mPriv->L, LUA_REGISTRYINDEX, mPriv->pushEventIdsRef);
+    lua_pushlightuserdata(mPriv->L, (void*) &events);
+    lua_rawgeti(mPriv->L, LUA_REGISTRYINDEX, mPriv->fsmRef);
+    lua_rawgeti(mPriv->L, LUA_REGISTRYINDEX, mPriv->eventsRef);
+    return (mPriv->pcall(3, 0) == LUA_OK);
+}
 
-    if(lua_pcall(mPriv->L, 0, 1, 0) != 0) {
-        yError()<<"StateMachine::getEventQueue()"<<lua_tostring(mPriv->L, -1)<<ENDL;
-        lua_pop(mPriv->L, 1);
+bool StateMachine::sendEventList(const std::vector<const char*>& events) {
+    if(!mPriv->isrFSMLoaded())
         return false;
+    for(size_t i=0; i<events.size(); i++) {
+        if(!mPriv->isKnownEvent(events[i]))
+            yWarning()<<"Sending the undefined event"<<events[i]<<ENDL;
     }
+    lua_rawgeti(mPriv->L, LUA_REGISTRYINDEX, mPriv->pushEventsRef);
+    lua_pushlightuserdata(mPriv->L, (void*) &events);
+    lua_rawgeti(mPriv->L, LUA_REGISTRYINDEX, mPriv->fsmRef);
+    return (mPriv->pcall(2, 0) == LUA_OK);
+}
 
-    if(!lua_istable(mPriv->L, -1)) {
-        yError()<<"StateMachine::getEventQueue() got wrong result type"<<ENDL;
-        lua_pop(mPriv->L, 1);
+
+bool StateMachine::postEvent(const std::string& event) {
+    if(!mPriv->postedEvents)
+        return false;
+    if(!mPriv->isKnownEvent(event.c_str()))
+        yWarning()<<"Posting the undefined event"<<event<<ENDL;
+    return mPriv->postedEvents->push(event);
+}
+
+bool StateMachine::postEvent(EventId event) {
+    if(!mPriv->postedEvents)
+        return false;
+    if(event < 0 || event >= (EventId) mPriv->events.size()) {
+        yError()<<"StateMachine::postEvent() got an invalid event id"<<event<<ENDL;
         return false;
     }
-    lua_pushnil(mPriv->L);
-    while(lua_next(mPriv->L, -2) != 0) {
-        if(lua_isstring(mPriv->L, -1))
-            equeue.push_back(lua_tostring(mPriv->L, -1));
-        else
-            yWarning()<<"StateMachine::getEventQueue() found a wrong type in the result from rfsm_get_event_queue()"<<ENDL;
-        lua_pop(mPriv->L, 1);
-    }
-    lua_pop(mPriv->L, 1); // pop the result from Lua stack
-    return true;
+    return mPriv->postedEvents->push(std::string(), event);
+}
+
+void StateMachine::setPostQueueSize(size_t size) {
+    mPriv->postQueueSize = size;
+}
+
+const std::vector<std::string>& StateMachine::getEventsList() {
+    return mPriv->events;
+}
+
+EventId StateMachine::eventId(const std::string& event) {
+    EventId id = eventId(eventHash(event.c_str()));
+    if(id == InvalidEventId || mPriv->events[id] != event)
+        return InvalidEventId;
+    return id;
+}
+
+EventId StateMachine::eventId(EventHash hash) {
+    std::unordered_map<EventHash, EventId>::const_iterator it = mPriv->eventIndex.find(hash);
+    return (it != mPriv->eventIndex.end()) ? it->second : InvalidEventId;
+}
+
+bool StateMachine::getEventQueue(std::vector<std::string>& equeue) {
+    if(!mPriv->isrFSMLoaded())
+        return false;
+    equeue.clear();
+    return mPriv->protect([&]() -> bool {
+        lua_getglobal(mPriv->L, "rfsm_get_event_queue");
+        if(!lua_isfunction(mPriv->L, -1)) {
+            yError()<<"StateMachine::getEventQueue() could not find rfsm_get_event_queue()"<<ENDL;
+            lua_pop(mPriv->L, 1);
+            return false;
+        }
+
+        lua_rawgeti(mPriv->L, LUA_REGISTRYINDEX, mPriv->fsmRef);
+        if(lua_pcall(mPriv->L, 1, 1, 0) != 0) {
+            yError()<<"StateMachine::getEventQueue()"<<lua_tostring(mPriv->L, -1)<<ENDL;
+            lua_pop(mPriv->L, 1);
+            return false;
+        }
+
+        if(!lua_istable(mPriv->L, -1)) {
+            yError()<<"StateMachine::getEventQueue() got wrong result type"<<ENDL;
+            lua_pop(mPriv->L, 1);
+            return false;
+        }
+        lua_pushnil(mPriv->L);
+        while(lua_next(mPriv->L, -2) != 0) {
+            if(lua_isstring(mPriv->L, -1))
+                equeue.push_back(lua_tostring(mPriv->L, -1));
+            else
+                yWarning()<<"StateMachine::getEventQueue() found a wrong type in the result from rfsm_get_event_queue()"<<ENDL;
+            lua_pop(mPriv->L, 1);
+        }
+        lua_pop(mPriv->L, 1); // pop the result from Lua stack
+        return true;
+    });
 }
 
 bool StateMachine::doString(const std::string& command) {
     CHECK_LUA_INITIALIZED(mPriv->L);
-    return (Utils::dostring(mPriv->L, command.c_str(), "command") == LUA_OK);
+    return mPriv->protect([&]() -> bool {
+        return (Utils::dostring(mPriv->L, command.c_str(), "command", !mPriv->realTimeGC) == LUA_OK);
+    });
 }
 
 bool StateMachine::doFile(const std::string& filename) {
     CHECK_LUA_INITIALIZED(mPriv->L);
-    return (Utils::dofile(mPriv->L, filename.c_str()) == LUA_OK);
+    return mPriv->protect([&]() -> bool {
+        return (Utils::dofile(mPriv->L, filename.c_str(), !mPriv->realTimeGC) == LUA_OK);
+    });
 }
 
 void StateMachine::addLuaPackagePath(const std::string& path) {
     mPriv->luaPackagePath += string(";")+path;
 }
 
+void StateMachine::setInstrumentedEngine(bool enable) {
+    mPriv->instrumented = enable;
+}
 
+void StateMachine::setModelCache(const std::string& directory, bool trusted) {
+    mPriv->cacheDirectory = directory;
+    mPriv->trustedCache = trusted;
+}
+
+void StateMachine::setAllocator(rfsm::Allocator* allocator) {
+    mPriv->allocator = allocator;
+}
+
+void StateMachine::setMemoryLimit(size_t bytes) {
+    mPriv->memoryLimit = bytes;
+}
+
+rfsm::MemoryStats StateMachine::getMemoryStats() {
+    return mPriv->memory;
+}
+
+bool StateMachine::setGCMode(rfsm::GCMode mode) {
+    mPriv->gcMode = mode;
+    return mPriv->applyGCMode();
+}
+
+void StateMachine::setRealTimeGC(bool enable) {
+    mPriv->realTimeGC = enable;
+    if(mPriv->L)
+        lua_gc(mPriv->L, (enable) ? LUA_GCSTOP : LUA_GCRESTART, 0);
+}
+
+bool StateMachine::collectGarbage(std::chrono::nanoseconds budget) {
+    CHECK_LUA_INITIALIZED(mPriv->L);
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    const std::chrono::steady_clock::time_point deadline = start + budget;
+    bool completed = false;
+    do {
+        mPriv->gcStats.steps++;
+        // a basic step of the collector, lua_gc() returns 1 at the end of a cycle
+        completed = (lua_gc(mPriv->L, LUA_GCSTEP, 0) == 1);
+    } while(!completed && std::chrono::steady_clock::now() < deadline);
+    // LUA_GCSTEP restarts the collector in lua 5.1
+    if(mPriv->realTimeGC)
+        lua_gc(mPriv->L, LUA_GCSTOP, 0);
+    if(completed)
+        mPriv->gcStats.cycles++;
+    unsigned long long elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
+    mPriv->gcStats.totalTime += elapsed;
+    mPriv->gcStats.maxTime = std::max(mPriv->gcStats.maxTime, elapsed);
+    return completed;
+}
+
+rfsm::GCStats StateMachine::getGCStats() {
+    rfsm::GCStats stats = mPriv->gcStats;
+    if(mPriv->L)
+        stats.memory = (size_t) lua_gc(mPriv->L, LUA_GCCOUNT, 0) * 1024 + (size_t) lua_gc(mPriv->L, LUA_GCCOUNTB, 0);
+    return stats;
+}
+
+
+// state.entry, state.exit and the function called by the state.doo
+// wrapper. the StateCallback is the first upvalue
 int StateMachine::Private::entryCallback(lua_State* L) {
-    if (lua_gettop(L) < 1) {
-        yError()<<"StateMachine::entryCallback() expects exactly one argument"<<ENDL;
-       return 0;
-    }
-    const char *cst = luaL_checkstring(L, -1);
-    if(cst) {
-        lua_getglobal(L, "RFSM_Owner");
-        if(!lua_islightuserdata(L, -1)) {
-            lua_pop(L, 1);
-            yError()<<"StateMachine::entryCallback() cannot access RFSM_Owner"<<ENDL;
-            return 0;
-        }
-        StateMachine* owner = static_cast<StateMachine*>(lua_touserdata(L, -1));
-        lua_pop(L, 1);
-        yAssert(owner!=NULL);
-        owner->mPriv->callEntryCallback(cst);
-    }
-    else
-        yError()<<"StateMachine::entryCallback() expects a string argument"<<ENDL;
+    rfsm::StateCallback* callback = static_cast<rfsm::StateCallback*>(lua_touserdata(L, lua_upvalueindex(1)));
+    yAssert(callback!=NULL);
+    callback->entry();
     return 0;
 }
 
-int StateMachine::Private::dooCallback(lua_State* L){
-    if (lua_gettop(L) < 1) {
-        yError()<<"StateMachine::dooCallback() expects exactly one argument"<<ENDL;
-       return 0;
-    }
-    const char *cst = luaL_checkstring(L, -1);
-    if(cst) {
-        lua_getglobal(L, "RFSM_Owner");
-        if(!lua_islightuserdata(L, -1)) {
-            lua_pop(L, 1);
-            yError()<<"StateMachine::dooCallback() cannot access RFSM_Owner"<<ENDL;
-            return 0;
-        }
-        StateMachine* owner = static_cast<StateMachine*>(lua_touserdata(L, -1));
-        lua_pop(L, 1);
-        yAssert(owner!=NULL);
-        owner->mPriv->callDooCallback(cst);
-    }
-    else
-        yError()<<"StateMachine::dooCallback() expects a string argument"<<ENDL;
+int StateMachine::Private::dooCallback(lua_State* L) {
+    rfsm::StateCallback* callback = static_cast<rfsm::StateCallback*>(lua_touserdata(L, lua_upvalueindex(1)));
+    yAssert(callback!=NULL);
+    callback->doo();
     return 0;
 }
 
-int StateMachine::Private::exitCallback(lua_State* L){
-    if (lua_gettop(L) < 1) {
-        yError()<<"StateMachine::exitCallback() expects exactly one argument"<<ENDL;
-       return 0;
-    }
-    const char *cst = luaL_checkstring(L, -1);
-    if(cst) {
-        lua_getglobal(L, "RFSM_Owner");
-        if(!lua_islightuserdata(L, -1)) {
+int StateMachine::Private::exitCallback(lua_State* L) {
+    rfsm::StateCallback* callback = static_cast<rfsm::StateCallback*>(lua_touserdata(L, lua_upvalueindex(1)));
+    yAssert(callback!=NULL);
+    callback->exit();
+    return 0;
+}
+
+// transition.guard(tr, events), the TransitionCallback and the Private are
+// the upvalues. the events are resolved into the reused guardEvents
+int StateMachine::Private::guardCallback(lua_State* L) {
+    rfsm::TransitionCallback* callback = static_cast<rfsm::TransitionCallback*>(lua_touserdata(L, lua_upvalueindex(1)));
+    Private* priv = static_cast<Private*>(lua_touserdata(L, lua_upvalueindex(2)));
+    yAssert(callback!=NULL && priv!=NULL);
+    priv->guardEvents.clear();
+    if(lua_istable(L, 2)) {
+        for(int i=1; ; i++) {
+            lua_rawgeti(L, 2, i);
+            const char* event = lua_isstring(L, -1) ? lua_tostring(L, -1) : NULL;
             lua_pop(L, 1);
-            yError()<<"StateMachine::exitCallback() cannot access RFSM_Owner"<<ENDL;
-            return 0;
+            if(event == NULL)
+                break;
+            std::unordered_map<EventHash, EventId>::const_iterator it = priv->eventIndex.find(eventHash(event));
+            if(it != priv->eventIndex.end() && priv->events[it->second] == event)
+                priv->guardEvents.push_back(it->second);
         }
-        StateMachine* owner = static_cast<StateMachine*>(lua_touserdata(L, -1));
-        lua_pop(L, 1);
-        yAssert(owner!=NULL);
-        owner->mPriv->callExitCallback(cst);
     }
-    else
-        yError()<<"StateMachine::exitCallback() expects a string argument"<<ENDL;
+    lua_pushboolean(L, callback->guard(priv->guardEvents));
+    return 1;
+}
+
+// transition.effect(fsm, tr, 'effect', events)
+int StateMachine::Private::effectCallback(lua_State* L) {
+    rfsm::TransitionCallback* callback = static_cast<rfsm::TransitionCallback*>(lua_touserdata(L, lua_upvalueindex(1)));
+    yAssert(callback!=NULL);
+    callback->effect();
     return 0;
 }
 
+// the owner StateMachine is the first upvalue of the following closures
 int StateMachine::Private::preStepCallback(lua_State* L) {
-    lua_getglobal(L, "RFSM_Owner");
-    if(!lua_islightuserdata(L, -1)) {
-        lua_pop(L, 1);
-        yError()<<"StateMachine::preStepCallback() cannot access RFSM_Owner"<<ENDL;
-        return 0;
-    }
-    StateMachine* owner = static_cast<StateMachine*>(lua_touserdata(L, -1));
-    lua_pop(L, 1);
+    StateMachine* owner = static_cast<StateMachine*>(lua_touserdata(L, lua_upvalueindex(1)));
     yAssert(owner!=NULL);
     owner->onPreStep();
     return 0;
 }
 
 int StateMachine::Private::postStepCallback(lua_State* L) {
-    lua_getglobal(L, "RFSM_Owner");
-    if(!lua_islightuserdata(L, -1)) {
-        lua_pop(L, 1);
-        yError()<<"StateMachine::preStepCallback() cannot access RFSM_Owner"<<ENDL;
-        return 0;
-    }
-    StateMachine* owner = static_cast<StateMachine*>(lua_touserdata(L, -1));
-    lua_pop(L, 1);
+    StateMachine* owner = static_cast<StateMachine*>(lua_touserdata(L, lua_upvalueindex(1)));
     yAssert(owner!=NULL);
     owner->onPostStep();
 	return 0;
 }
 
 int StateMachine::Private::warningCallback(lua_State* L) {
-    std::string message;
-    StateMachine* owner;
-    if(getLuaFuncStringParam(L, owner, message))
-        owner->onWarning(message);
-    else
-        yError()<<"StateMachine::warningCallback() failed on getLuaFuncStringParam"<<ENDL;
+    StateMachine* owner = static_cast<StateMachine*>(lua_touserdata(L, lua_upvalueindex(1)));
+    yAssert(owner!=NULL);
+    owner->onWarning(packArgs(L, " ", true));
     return 0;
 }
 
 int StateMachine::Private::errorCallback(lua_State* L) {
-    std::string message;
-    StateMachine* owner;
-    if(getLuaFuncStringParam(L, owner, message))
-        owner->onError(message);
-    else
-        yError()<<"StateMachine::errorCallback() failed on getLuaFuncStringParam"<<ENDL;
+    StateMachine* owner = static_cast<StateMachine*>(lua_touserdata(L, lua_upvalueindex(1)));
+    yAssert(owner!=NULL);
+    owner->onError(packArgs(L, " ", true));
     return 0;
 }
 
 int StateMachine::Private::infoCallback(lua_State* L) {
-    std::string message;
-    StateMachine* owner;
-    if(getLuaFuncStringParam(L, owner, message))
-        owner->onInfo(message);
-    else
-        yError()<<"StateMachine::infoCallback() failed on getLuaFuncStringParam"<<ENDL;
+    StateMachine* owner = static_cast<StateMachine*>(lua_touserdata(L, lua_upvalueindex(1)));
+    yAssert(owner!=NULL);
+    owner->onInfo(packArgs(L, " ", true));
     return 0;
 }
 
 
 int StateMachine::Private::luaPrint(lua_State* L) {
+    StateMachine* owner = static_cast<StateMachine*>(lua_touserdata(L, lua_upvalueindex(1)));
+    yAssert(owner!=NULL);
+    owner->onInfo(packArgs(L, "\t", false));
+    return 0;
+}
+
+// the lua_Alloc of the lua state, ud is the Private. osize is not
+// the size of the block if ptr is NULL (it is the object type in lua 5.4)
+void* StateMachine::Private::allocate(void* ud, void* ptr, size_t osize, size_t nsize) {
+    Private* priv = static_cast<Private*>(ud);
+    size_t old = (ptr) ? osize : 0;
+    if(nsize == 0) {
+        if(ptr) {
+            if(priv->allocator)
+                priv->allocator->deallocate(ptr, old);
+            else
+                free(ptr);
+            priv->memory.liveBytes -= old;
+        }
+        return NULL;
+    }
+    if(nsize > old && priv->memoryLimit &&
+       priv->memory.liveBytes - old + nsize > priv->memoryLimit) {
+        priv->memory.failures++;
+        return NULL;
+    }
+    void* block;
+    if(priv->allocator)
+        block = (ptr) ? priv->allocator->reallocate(ptr, old, nsize) : priv->allocator->allocate(nsize);
+    else
+        block = realloc(ptr, nsize);
+    if(block == NULL) {
+        priv->memory.failures++;
+        return NULL;
+    }
+    if(ptr == NULL)
+        priv->memory.allocations++;
+    priv->memory.liveBytes = priv->memory.liveBytes - old + nsize;
+    if(priv->memory.liveBytes > priv->memory.peakBytes)
+        priv->memory.peakBytes = priv->memory.liveBytes;
+    return block;
+}
+
+// called on errors outside of any protected call. It should never happen
+// since the lua code runs through pcall() or protect()
+int StateMachine::Private::panic(lua_State* L) {
+    const char* msg = lua_tostring(L, -1);
+    yError()<<"lua panic:"<<((msg) ? msg : "(error object is not a string)")<<ENDL;
+    return 0;
+}
+
+// concatenates the arguments of a C function converted by tostring().
+// the printers stop at the first nil argument as ipairs() does
+std::string StateMachine::Private::packArgs(lua_State* L, const char* separator, bool trailing) {
     std::string message;
     int nargs = lua_gettop(L);
-    for(int i=1; i <= nargs; ++i)
-        message += (message.size()) ? std::string("\t") + lua_tostring(L, i) : lua_tostring(L, i);
+    for(int i=1; i <= nargs; ++i) {
+        if(trailing && lua_isnil(L, i))
+            break;
+        if(!trailing && i > 1)
+            message += separator;
+        if(lua_type(L, i) == LUA_TSTRING || lua_type(L, i) == LUA_TNUMBER)
+            message += lua_tostring(L, i);
+        else {
+            lua_getglobal(L, "tostring");
+            lua_pushvalue(L, i);
+            lua_call(L, 1, 1);
+            const char* str = lua_tostring(L, -1);
+            message += (str) ? str : "";
+            lua_pop(L, 1);
+        }
+        if(trailing)
+            message += separator;
+    }
+    return message;
+}
+
+// appends the events given as a light userdata (std::vector<const char*>)
+// to the internal queue of the fsm given as the second argument
+int StateMachine::Private::pushEvents(lua_State* L) {
+    const std::vector<const char*>* events = static_cast<const std::vector<const char*>*>(lua_touserdata(L, 1));
+    yAssert(events != NULL);
+    lua_getfield(L, 2, "_intq");
+    luaL_checktype(L, -1, LUA_TTABLE);
+    int n = lua_objlen(L, -1);
+    for(size_t i=0; i<events->size(); i++) {
+        lua_pushstring(L, (*events)[i]);
+        lua_rawseti(L, -2, ++n);
+    }
+    return 0;
+}
 
-    lua_getglobal(L, "RFSM_Owner");
-    if(!lua_islightuserdata(L, -1)) {
+// same as pushEvents() for the ids (std::vector<EventId>) given as
+// the first argument. the third argument is the table of event names
+int StateMachine::Private::pushEventIds(lua_State* L) {
+    const std::vector<EventId>* events = static_cast<const std::vector<EventId>*>(lua_touserdata(L, 1));
+    yAssert(events != NULL);
+    lua_getfield(L, 2, "_intq");
+    luaL_checktype(L, -1, LUA_TTABLE);
+    int n = lua_objlen(L, -1);
+    for(size_t i=0; i<events->size(); i++) {
+        lua_rawgeti(L, 3, (*events)[i] + 1);
+        lua_rawseti(L, -2, ++n);
+    }
+    return 0;
+}
+
+// calls rfsm.send_events(fsm, event) with the event given as a light userdata
+// (std::string) so that its lua string is created within the protected call.
+// the 1st argument is the Private
+int StateMachine::Private::sendEventString(lua_State* L) {
+    Private* priv = static_cast<Private*>(lua_touserdata(L, 1));
+    const std::string* event = static_cast<const std::string*>(lua_touserdata(L, 2));
+    yAssert(priv != NULL && event != NULL);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, priv->sendEventsRef);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, priv->fsmRef);
+    lua_pushlstring(L, event->data(), event->size());
+    lua_call(L, 2, 0);
+    return 0;
+}
+
+// fsm.getevents hook: moves the posted events into the internal queue and
+// returns the result of the previous hook (second upvalue)
+int StateMachine::Private::getEvents(lua_State* L) {
+    Private* priv = static_cast<Private*>(lua_touserdata(L, lua_upvalueindex(1)));
+    yAssert(priv != NULL && priv->postedEvents != NULL);
+    if(!priv->postedEvents->empty()) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, priv->eventsRef);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, priv->fsmRef);
+        lua_getfield(L, -1, "_intq");
+        luaL_checktype(L, -1, LUA_TTABLE);
+        int n = lua_objlen(L, -1);
+        EventId id;
+        while(priv->postedEvents->pop(priv->postedEvent, id)) {
+            if(id == InvalidEventId)
+                lua_pushlstring(L, priv->postedEvent.data(), priv->postedEvent.size());
+            else
+                lua_rawgeti(L, -3, id + 1);
+            lua_rawseti(L, -2, ++n);
+        }
+        lua_pop(L, 3);
+    }
+    lua_pushvalue(L, lua_upvalueindex(2));
+    lua_call(L, 0, 1);
+    return 1;
+}
+
+// steps the fsm after appending the optional event (4th argument, a lua string
+// or a C string as light userdata) to its queue. the 1st and 2nd arguments are
+// the Private and the StepResult (if not NULL) as light userdata, the 3rd one
+// the number of steps
+int StateMachine::Private::stepMachine(lua_State* L) {
+    Private* priv = static_cast<Private*>(lua_touserdata(L, 1));
+    StepResult* result = static_cast<StepResult*>(lua_touserdata(L, 2));
+    yAssert(priv != NULL);
+    if(lua_islightuserdata(L, 4)) {
+        lua_pushstring(L, static_cast<const char*>(lua_touserdata(L, 4)));
+        lua_replace(L, 4);
+    }
+    lua_rawgeti(L, LUA_REGISTRYINDEX, priv->fsmRef);
+    const int fsm = lua_gettop(L);
+    if(!lua_isnil(L, 4)) {
+        lua_getfield(L, fsm, "_intq");
+        luaL_checktype(L, -1, LUA_TTABLE);
+        lua_pushvalue(L, 4);
+        lua_rawseti(L, -2, lua_objlen(L, -2) + 1);
         lua_pop(L, 1);
-        yError()<<"StateMachine::luaPrint() cannot access RFSM_Owner"<<ENDL;
-        return false;
     }
-    StateMachine* owner = static_cast<StateMachine*>(lua_touserdata(L, -1));
+    if(result)
+        priv->resetStepCounters(fsm);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, priv->stepRef);
+    lua_pushvalue(L, fsm);
+    lua_pushvalue(L, 3);
+    lua_call(L, 2, 1);
+    if(result) {
+        result->idle = (lua_toboolean(L, -1) == 1);
+        priv->getStepResult(fsm, *result);
+    }
+    return 0;
+}
+
+// steps the fsm one step at a time until it is idle, the number of steps
+// (3rd argument) is reached or the deadline (4th argument) is passed.
+// the 1st and 2nd arguments are the Private and the StepResult. As in
+// rfsm.step(), fsm.idle_hook is called on an idle step if steps remain
+// and the machine is idle only if there is no hook
+int StateMachine::Private::runMachine(lua_State* L) {
+    Private* priv = static_cast<Private*>(lua_touserdata(L, 1));
+    StepResult* result = static_cast<StepResult*>(lua_touserdata(L, 2));
+    lua_Number maxSteps = lua_tonumber(L, 3);
+    const std::chrono::steady_clock::time_point* deadline =
+            static_cast<const std::chrono::steady_clock::time_point*>(lua_touserdata(L, 4));
+    yAssert(priv != NULL && result != NULL && deadline != NULL);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, priv->fsmRef);
+    const int fsm = lua_gettop(L);
+    priv->resetStepCounters(fsm);
+    result->idle = false;
+    for(lua_Number n=0; n<maxSteps; n++) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, priv->stepRef);
+        lua_pushvalue(L, fsm);
+        lua_pushinteger(L, 1);
+        lua_call(L, 2, 1);
+        result->idle = (lua_toboolean(L, -1) == 1);
+        lua_pop(L, 1);
+        if(std::chrono::steady_clock::now() >= *deadline)
+            break;
+        if(result->idle) {
+            if(n + 1 >= maxSteps)
+                break;
+            lua_getfield(L, fsm, "idle_hook");
+            if(!lua_toboolean(L, -1)) {
+                lua_pop(L, 1);
+                break;
+            }
+            lua_pushvalue(L, fsm);
+            lua_call(L, 1, 0);
+            result->idle = false;
+        }
+    }
+    priv->getStepResult(fsm, *result);
+    return 0;
+}
+
+// returns the _cid of the state given as the first argument of a hook
+int StateMachine::Private::getStateId(lua_State* L, Private* priv) {
+    lua_getfield(L, 1, "_cid");
+    int id = lua_isnumber(L, -1) ? (int) lua_tointeger(L, -1) : -1;
     lua_pop(L, 1);
-    yAssert(owner!=NULL);
-    owner->onInfo(message);
+    if(id < 0 || id >= (int) priv->stateNames.size())
+        return -1;
+    return id;
+}
+
+// fsm._enter_hook: appends the entered state to the active configuration.
+// onStateChanged() is called when the entered state is a leaf
+int StateMachine::Private::enterHook(lua_State* L) {
+    StateMachine* owner = static_cast<StateMachine*>(lua_touserdata(L, lua_upvalueindex(1)));
+    yAssert(owner != NULL);
+    Private* priv = owner->mPriv;
+    int id = getStateId(L, priv);
+    if(id < 0)
+        return 0;
+    priv->activeChain.resize(priv->stateDepth[id]);
+    priv->activeChain.push_back(id);
+    if(priv->stateLeaf[id]) {
+        int previous = priv->activeLeaf;
+        priv->activeLeaf = id;
+        owner->onStateChanged((previous < 0) ? "<none>" : priv->stateNames[previous],
+                              priv->stateNames[id]);
+    }
     return 0;
 }
 
-bool StateMachine::Private::getLuaFuncStringParam(lua_State* L, StateMachine* &owner , std::string& strParam) {
-    if (lua_gettop(L) < 1) {
-        yError()<<"StateMachine::getLuaFuncStringParam() expects exactly one argument"<<ENDL;
-       return false;
+// fsm._exit_hook: removes the exited state and its substates from
+// the active configuration (the root clears it)
+int StateMachine::Private::exitHook(lua_State* L) {
+    StateMachine* owner = static_cast<StateMachine*>(lua_touserdata(L, lua_upvalueindex(1)));
+    yAssert(owner != NULL);
+    Private* priv = owner->mPriv;
+    int id = getStateId(L, priv);
+    if(id < 0)
+        return 0;
+    if(priv->stateDepth[id] < priv->activeChain.size())
+        priv->activeChain.resize(priv->stateDepth[id]);
+    return 0;
+}
+
+// the kinds of the transition targets given by rfsm_dispatch_tables()
+#define NODE_LEAF       1
+#define NODE_CONNECTOR  2
+
+// fsm._find_enabled(fsm, events [, start]): the native rfsm.fsm_find_enabled().
+// It walks down the active configuration and returns the first path enabled by
+// the events, or the path from start if given (see rfsm.node_find_enabled()).
+// Returns false if no path is enabled. The upvalues are the owner, the nodes
+// (nodes[id] and nodes[node]=id), the transitions and the event bits.
+int StateMachine::Private::findEnabled(lua_State* L) {
+    Private* priv = static_cast<Private*>(lua_touserdata(L, lua_upvalueindex(1)));
+    yAssert(priv != NULL);
+    lua_settop(L, 3);
+    priv->setQueuedEvents(L, 2);
+    if(!lua_isnil(L, 3)) {
+        lua_pushvalue(L, 3);
+        lua_rawget(L, lua_upvalueindex(2));
+        int id = (int) lua_tointeger(L, -1);
+        lua_pop(L, 1);
+        if(!priv->findPath(L, id, 3))
+            lua_pushboolean(L, 0);
+        return 1;
     }
+    lua_pushvalue(L, 1);
+    while(lua_istable(L, -1)) {
+        int state = lua_gettop(L);
+        lua_pushvalue(L, state);
+        lua_rawget(L, lua_upvalueindex(2));
+        int id = (int) lua_tointeger(L, -1);
+        lua_pop(L, 1);
+        if(priv->findPath(L, id, state))
+            return 1;
+        lua_getfield(L, state, "_actchild");
+        lua_remove(L, state);
+    }
+    lua_pushboolean(L, 0);
+    return 1;
+}
 
-    const char *cst = luaL_checkstring(L, -1);
-    if(cst) {
-        lua_getglobal(L, "RFSM_Owner");
-        if(!lua_islightuserdata(L, -1)) {
+// encodes the events of the step as a bitset (the unknown ones trigger nothing)
+void StateMachine::Private::setQueuedEvents(lua_State* L, int events) {
+    std::fill(queuedEvents.begin(), queuedEvents.end(), 0);
+    if(!lua_istable(L, events))
+        return;
+    for(int i=1; ; i++) {
+        lua_rawgeti(L, events, i);
+        if(lua_isnil(L, -1)) {
             lua_pop(L, 1);
-            yError()<<"StateMachine::getLuaFuncStringParam() cannot access RFSM_Owner"<<ENDL;
-            return false;
+            break;
+        }
+        lua_rawget(L, lua_upvalueindex(4));
+        if(lua_isnumber(L, -1)) {
+            size_t bit = (size_t) lua_tointeger(L, -1);
+            queuedEvents[bit / 64] |= (uint64_t) 1 << (bit % 64);
         }
-        owner = static_cast<StateMachine*>(lua_touserdata(L, -1));
         lua_pop(L, 1);
-        yAssert(owner!=NULL);
-        strParam = cst;
-        return true;
     }
-    else
-        yError()<<"StateMachine::getLuaFuncStringParam() expects a string argument"<<ENDL;
-    return false;
 }
 
-void StateMachine::Private::callEntryCallback(const std::string& state) {
-    std::map<string,StateCallback*>::iterator it;
-    if ((it = callbacks.find(state)) == callbacks.end())
-        return;
-    it->second->entry();
+bool StateMachine::Private::isTriggered(const std::vector<uint64_t>& events) {
+    for(size_t i=0; i<eventWords; i++) {
+        if(events[i] & queuedEvents[i])
+            return true;
+    }
+    return false;
 }
 
-void StateMachine::Private::callDooCallback(const std::string& state) {
-    std::map<string,StateCallback*>::iterator it;
-    if ((it = callbacks.find(state)) == callbacks.end())
-        return;
-    it->second->doo();
+// pushes the path { node=nd, nextl={ {trans=tr, next=tail}, ... } } of the
+// transitions from the node which are enabled by the queued events, in the
+// order of node._otrs. Only the guards of the triggered transitions are called
+// and the tables are created only for the enabled paths. Returns false and
+// leaves the stack untouched if there is none. It runs within fsm._find_enabled
+// (the fsm is at index 1 and the events at index 2).
+bool StateMachine::Private::findPath(lua_State* L, int node, int start) {
+    if(node < 1 || node > (int) dispatch.size())
+        return false;
+    const DispatchNode& dnode = dispatch[node-1];
+    if(!dnode.eventless && !isTriggered(dnode.events))
+        return false;
+    luaL_checkstack(L, 10, "too many connectors in a path");
+    int base = lua_gettop(L);
+    int cur = 0;
+    int count = 0;
+    for(size_t i=0; i<dnode.transitions.size(); i++) {
+        const DispatchTransition& tr = dnode.transitions[i];
+        if(!tr.eventless && !isTriggered(tr.events))
+            continue;
+        lua_rawgeti(L, lua_upvalueindex(3), tr.trans);
+        if(checkGuard(L, lua_gettop(L))) {
+            // finding the continuation
+            bool found = false;
+            if(tr.kind == NODE_LEAF) {
+                lua_createtable(L, 0, 2);
+                lua_rawgeti(L, lua_upvalueindex(2), tr.target);
+                lua_setfield(L, -2, "node");
+                lua_pushboolean(L, 0);
+                lua_setfield(L, -2, "nextl");
+                found = true;
+            }
+            else if(tr.kind == NODE_CONNECTOR)
+                found = findPath(L, tr.target, start);
+            else {
+                lua_getfield(L, 1, "err");
+                lua_getfield(L, start, "_fqn");
+                lua_getfield(L, start, "type");
+                lua_pushvalue(L, start);
+                lua_call(L, 1, 1);
+                lua_pushfstring(L, "ERROR: node_find_path invalid starting node%s, type%s",
+                                lua_tostring(L, -2), lua_tostring(L, -1));
+                lua_replace(L, -3);
+                lua_pop(L, 1);
+                lua_call(L, 1, 0);
+            }
+            if(found) {
+                // the path node is created with its first segment
+                if(!cur) {
+                    lua_createtable(L, 0, 2);
+                    lua_rawgeti(L, lua_upvalueindex(2), node);
+                    lua_setfield(L, -2, "node");
+                    lua_newtable(L);
+                    lua_pushvalue(L, -1);
+                    lua_setfield(L, -3, "nextl");
+                    lua_insert(L, base + 1);
+                    lua_insert(L, base + 1);
+                    cur = base + 1;
+                }
+                // stack: tr, tail
+                lua_createtable(L, 0, 2);
+                lua_insert(L, -2);
+                lua_setfield(L, -2, "next");
+                lua_pushvalue(L, -2);
+                lua_setfield(L, -2, "trans");
+                lua_rawseti(L, cur + 1, ++count);
+            }
+        }
+        lua_settop(L, cur ? cur + 1 : base);
+    }
+    if(!cur)
+        return false;
+    lua_settop(L, cur);
+    return true;
 }
 
-void StateMachine::Private::callExitCallback(const std::string& state) {
-    std::map<string,StateCallback*>::iterator it;
-    if ((it = callbacks.find(state)) == callbacks.end())
-        return;
-    it->second->exit();
+// calls the guard of the transition, if any (see rfsm.is_enabled())
+bool StateMachine::Private::checkGuard(lua_State* L, int tr) {
+    lua_getfield(L, tr, "guard");
+    if(!lua_toboolean(L, -1)) {
+        lua_pop(L, 1);
+        return true;
+    }
+    lua_pushvalue(L, tr);
+    lua_pushvalue(L, 2);
+    if(lua_pcall(L, 2, 1, 0) != 0) {
+        int error = lua_gettop(L);
+        lua_getfield(L, 1, "err");
+        lua_pushstring(L, "GUARD");
+        lua_getglobal(L, "tostring");
+        lua_pushvalue(L, tr);
+        lua_call(L, 1, 1);
+        lua_pushfstring(L, "error executing guard of %s: ", lua_tostring(L, -1));
+        lua_remove(L, -2);
+        lua_pushvalue(L, error);
+        lua_call(L, 3, 0);
+        lua_pop(L, 1);
+        return false;
+    }
+    bool rejected = lua_isboolean(L, -1) && !lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    return !rejected;
 }
 
 bool StateMachine::Private::isrFSMLoaded() {
     CHECK_LUA_INITIALIZED(L);
-    lua_getglobal(L, "fsm");
-    return lua_istable(L, -1);
+    return (fsmRef != LUA_NOREF);
+}
+
+bool StateMachine::Private::isKnownEvent(const char* event) {
+    std::unordered_map<EventHash, EventId>::const_iterator it = eventIndex.find(eventHash(event));
+    return (it != eventIndex.end()) && (events[it->second] == event);
 }
 
 bool StateMachine::setStateCallback(const string &state, rfsm::StateCallback& callback) {
     if(!mPriv->isrFSMLoaded())
         return false;
-    lua_getglobal(mPriv->L, "rfsm_set_state_callbacks");
-    if(!lua_isfunction(mPriv->L, -1)) {
-        yError()<<"StateMachine::setStateCallback() could not find rfsm_set_state_callbacks()"<<ENDL;
+    StateId id = stateId(state);
+    if(id == InvalidStateId) {
+        yWarning()<<"State"<<state<<"does not exist"<<ENDL;
         return false;
     }
+    return mPriv->bindStateCallback(id, &callback);
+}
 
-    lua_pushstring(mPriv->L, state.c_str());
-    if(lua_pcall(mPriv->L, 1, 1, 0) != 0) {
-        yError()<<"StateMachine::setStateCallback()"<<lua_tostring(mPriv->L, -1)<<ENDL;
-        lua_pop(mPriv->L, 1);
+bool StateMachine::setStateCallbacks(const std::map<std::string, rfsm::StateCallback*>& callbacks) {
+    if(!mPriv->isrFSMLoaded())
         return false;
+    std::string unknown;
+    bool result = true;
+    std::map<std::string, rfsm::StateCallback*>::const_iterator itr;
+    for(itr = callbacks.begin(); itr != callbacks.end(); itr++) {
+        StateId id = stateId(itr->first);
+        if(id == InvalidStateId) {
+            unknown += (unknown.size()) ? ", " + itr->first : itr->first;
+            result = false;
+        }
+        else if(itr->second)
+            result &= mPriv->bindStateCallback(id, itr->second);
     }
-
-    // converting the results
-    bool result = (lua_toboolean(mPriv->L, -1) == 1);
-    lua_pop(mPriv->L, 1); // pop the result from Lua stack    
-    if(result)
-        mPriv->callbacks[state] = &callback;
-    else
-        yWarning()<<"State"<<state<<"does not exist"<<ENDL;
+    if(unknown.size())
+        yWarning()<<"States"<<unknown<<"do not exist"<<ENDL;
     return result;
 }
 
+bool StateMachine::setTransitionCallback(const std::string& source, const std::string& target,
+                                         rfsm::TransitionCallback& callback, unsigned int members) {
+    if(!mPriv->isrFSMLoaded())
+        return false;
+    bool found = false;
+    bool result = mPriv->protect([&]() -> bool {
+        lua_getglobal(mPriv->L, "rfsm_set_transition_callback");
+        if(!lua_isfunction(mPriv->L, -1)) {
+            yError()<<"StateMachine::setTransitionCallback() could not find rfsm_set_transition_callback()"<<ENDL;
+            return false;
+        }
+        lua_rawgeti(mPriv->L, LUA_REGISTRYINDEX, mPriv->fsmRef);
+        lua_pushstring(mPriv->L, source.c_str());
+        lua_pushstring(mPriv->L, target.c_str());
+        // the members which are not set are passed as nil and kept
+        if(members & TransitionCallback::Guard) {
+            lua_pushlightuserdata(mPriv->L, &callback);
+            lua_pushlightuserdata(mPriv->L, mPriv);
+            lua_pushcclosure(mPriv->L, StateMachine::Private::guardCallback, 2);
+        }
+        else
+            lua_pushnil(mPriv->L);
+        if(members & TransitionCallback::Effect) {
+            lua_pushlightuserdata(mPriv->L, &callback);
+            lua_pushcclosure(mPriv->L, StateMachine::Private::effectCallback, 1);
+        }
+        else
+            lua_pushnil(mPriv->L);
+        if(mPriv->pcall(5, 1) != LUA_OK)
+            return false;
+        found = (lua_toboolean(mPriv->L, -1) == 1);
+        return true;
+    });
+    if(result && !found)
+        yWarning()<<"Transition"<<source<<"->"<<target<<"does not exist"<<ENDL;
+    return result && found;
+}
+
 const std::string StateMachine::getCurrentState() {
     if(!mPriv->isrFSMLoaded()) {
         return "";
     }
+    if(mPriv->activeChain.empty())
+        return "<none>";
+    return mPriv->stateNames[mPriv->activeChain.back()];
+}
 
-    lua_getglobal(mPriv->L, "rfsm_get_current_state");
-    if(!lua_isfunction(mPriv->L, -1)) {
-        yError()<<"StateMachine::getCurrentState() could not find rfsm_get_current_state()"<<ENDL;
-        return "";
-    }
-
-    if(lua_pcall(mPriv->L, 0, 1, 0) != 0) {
-        yError()<<"StateMachine::getCurrentState()"<<lua_tostring(mPriv->L, -1)<<ENDL;        
-        return "";
-    }
-
-    if(lua_type(mPriv->L, -1) != LUA_TSTRING) {
-        yError()<<"StateMachine::getCurrentState() got wrong result type"<<ENDL;
-        lua_pop(mPriv->L, 1); // pop the result from Lua stack        
+const std::string StateMachine::stateName(StateId state) {
+    if(state < 0 || state >= (StateId) mPriv->stateNames.size())
         return "";
-    }
-    // converting the results
-    string result = lua_tostring(mPriv->L, -1);
-    std::size_t pos = result.find("root.");
-    if(pos != std::string::npos)
-        result.erase(pos, 5);
-    lua_pop(mPriv->L, 1); // pop the result from Lua stack
-    return result;
+    return mPriv->stateNames[state];
+}
+
+StateId StateMachine::stateId(const std::string& state) {
+    std::unordered_map<std::string, StateId>::const_iterator itr = mPriv->stateIndex.find(state);
+    return (itr != mPriv->stateIndex.end()) ? itr->second : InvalidStateId;
+}
+
+bool StateMachine::getActiveConfiguration(std::vector<std::string>& states) {
+    states.clear();
+    if(!mPriv->isrFSMLoaded())
+        return false;
+    for(size_t i=0; i<mPriv->activeChain.size(); i++)
+        states.push_back(mPriv->stateNames[mPriv->activeChain[i]]);
+    return true;
 }
 
 const rfsm::StateGraph& StateMachine::getStateGraph() {
-    return mPriv->graph;
+    return mPriv->stateGraph();
 }
 
 
@@ -527,19 +1334,24 @@ const rfsm::StateGraph& StateMachine::getStateGraph() {
 bool StateMachine::enablePreStepHook() {
     if(!mPriv->isrFSMLoaded())
         return false;
-    return (Utils::dostring(mPriv->L, "rfsm.pre_step_hook_add(fsm, rfsm_pre_step_hook)", "rfsm_pre_step_hook") != LUA_OK);
+    return mPriv->addStepHook("pre_step_hook_add", StateMachine::Private::preStepCallback, this);
 }
 
 
 bool StateMachine::enablePostStepHook() {
     if(!mPriv->isrFSMLoaded())
         return false;
-    return (Utils::dostring(mPriv->L, "rfsm.post_step_hook_add(fsm, rfsm_post_step_hook)", "rfsm_post_step_hook") != LUA_OK);
+    return mPriv->addStepHook("post_step_hook_add", StateMachine::Private::postStepCallback, this);
 }
 
 bool StateMachine::catchPrintOutput() {
     CHECK_LUA_INITIALIZED(mPriv->L);
-    return mPriv->registerCFunction("print", StateMachine::Private::luaPrint, true);
+    return mPriv->protect([this]() -> bool {
+        lua_pushlightuserdata(mPriv->L, this);
+        lua_pushcclosure(mPriv->L, StateMachine::Private::luaPrint, 1);
+        lua_setglobal(mPriv->L, "print");
+        return true;
+    });
 }
 
 void StateMachine::onPreStep() {
@@ -547,6 +1359,11 @@ void StateMachine::onPreStep() {
         yDebug()<<"onPreStep(): current state:"<<getCurrentState()<<ENDL;
 }
 
+void StateMachine::onStateChanged(const std::string& previous, const std::string& current) {
+    if(verbose)
+        yDebug()<<"onStateChanged():"<<previous<<"->"<<current<<ENDL;
+}
+
 void StateMachine::onPostStep() {
     if(verbose)
         yDebug()<<"onPostStep(): current state:"<<getCurrentState()<<ENDL;
@@ -576,109 +1393,295 @@ void StateMachine::onTrace(const std::string& message ) {
 /**********************************************************
 * class StateMachine::Private
 ***********************************************************/
-bool StateMachine::Private::registerCFunction(const std::string& name, lua_CFunction func, bool global) {
-    if(!func)
-        return false;
-    luaL_reg reg;
-    if(luaFuncReg.size()) {
-        luaFuncReg.back().name = name.c_str();
-        luaFuncReg.back().func = func;
-    }
-    else {
-        reg.name = name.c_str();
-        reg.func = func;
-        luaFuncReg.push_back(reg);
-    }
-    reg.name = 0;
-    reg.func = 0;
-    luaFuncReg.push_back(reg);
-#if LUA_VERSION_NUM > 501
-    if(global) {
-        lua_getglobal(L, "_G");
-        luaL_setfuncs(L, &luaFuncReg[0], 0);
-        lua_pop(L, 1);
+// sets the entry, doo and exit of a state to closures holding the callback
+bool StateMachine::Private::bindStateCallback(StateId state, rfsm::StateCallback* callback) {
+    return protect([this, state, callback]() -> bool {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, statesRef);
+        lua_rawgeti(L, -1, state + 1);
+        if(!lua_istable(L, -1)) {
+            yError()<<"StateMachine::setStateCallback() cannot find the state"<<stateNames[state]<<ENDL;
+            lua_pop(L, 2);
+            return false;
+        }
+        lua_pushlightuserdata(L, callback);
+        lua_pushcclosure(L, StateMachine::Private::entryCallback, 1);
+        lua_setfield(L, -2, "entry");
+        lua_pushlightuserdata(L, callback);
+        lua_pushcclosure(L, StateMachine::Private::exitCallback, 1);
+        lua_setfield(L, -2, "exit");
+        // coroutine.create() needs a lua function
+        lua_getglobal(L, "rfsm_doo_wrapper");
+        if(!lua_isfunction(L, -1)) {
+            yError()<<"StateMachine::setStateCallback() could not find rfsm_doo_wrapper()"<<ENDL;
+            lua_pop(L, 3);
+            return false;
+        }
+        lua_pushlightuserdata(L, callback);
+        lua_pushcclosure(L, StateMachine::Private::dooCallback, 1);
+        if(pcall(1, 1) != LUA_OK) {
+            lua_pop(L, 2);
+            return false;
+        }
+        lua_setfield(L, -2, "doo");
+        lua_pop(L, 2);
+        return true;
+    });
+}
+
+// sets the field name of the fsm table at the given stack index
+// to a closure of func with the owner as upvalue
+void StateMachine::Private::setPrinter(int table, const char* name, lua_CFunction func, StateMachine* owner) {
+    if(!lua_istable(L, table))
+        return;
+    lua_pushlightuserdata(L, owner);
+    lua_pushcclosure(L, func, 1);
+    lua_setfield(L, table, name);
+}
+
+// sets the printers of the fsm table at the given stack index.
+// the warnings and the info are discarded if not verbose
+void StateMachine::Private::setPrinters(int table, StateMachine* owner, bool verbose) {
+    if(!lua_istable(L, table))
+        return;
+    if(!verbose) {
+        lua_getglobal(L, "rfsm_null_func");
+        lua_setfield(L, table, "warn");
+        lua_getglobal(L, "rfsm_null_func");
+        lua_setfield(L, table, "info");
     }
     else {
-        if(luaFuncReg.size() <= 2)
-            lua_newtable(L);
-        luaL_setfuncs (L, &luaFuncReg[0], 0);
-        lua_pushvalue(L, -1);
-        if(luaFuncReg.size() <= 2)
-            lua_setglobal(L, "RFSM");
+        setPrinter(table, "warn", StateMachine::Private::warningCallback, owner);
+        setPrinter(table, "info", StateMachine::Private::infoCallback, owner);
     }
+    setPrinter(table, "err", StateMachine::Private::errorCallback, owner);
+}
+
+// calls rfsm[adder](fsm, hook) where hook is a closure of func
+bool StateMachine::Private::addStepHook(const char* adder, lua_CFunction func, StateMachine* owner) {
+    return protect([this, adder, func, owner]() -> bool {
+        lua_getglobal(L, "rfsm");
+        lua_getfield(L, -1, adder);
+        lua_remove(L, -2);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, fsmRef);
+        lua_pushlightuserdata(L, owner);
+        lua_pushcclosure(L, func, 1);
+        return (pcall(2, 0) == LUA_OK);
+    });
+}
+
+// sets the mode of the garbage collector if the lua state exists
+bool StateMachine::Private::applyGCMode() {
+#if LUA_VERSION_NUM >= 504
+    if(L)
+        lua_gc(L, (gcMode == GCGenerational) ? LUA_GCGEN : LUA_GCINC, 0, 0);
+    return true;
 #else
-    if(global) {
-        lua_getglobal(L, "_G");
-        luaL_register(L, NULL, &luaFuncReg[0]);
-        lua_pop(L, 1);
+    if(gcMode == GCGenerational) {
+        yWarning()<<"The generational garbage collector requires lua 5.4"<<ENDL;
+        return false;
     }
-    else
-        luaL_register(L, "RFSM", &luaFuncReg[0]);
-#endif
     return true;
+#endif
 }
 
-bool StateMachine::Private::registerAuxiliaryFunctions() {
-    registerCFunction("entryCallback", StateMachine::Private::entryCallback);
-    registerCFunction("dooCallback", StateMachine::Private::dooCallback);
-    registerCFunction("exitCallback", StateMachine::Private::exitCallback);
-    registerCFunction("preStepCallback", StateMachine::Private::preStepCallback);
-    registerCFunction("postStepCallback", StateMachine::Private::postStepCallback);    
-    registerCFunction("warningCallback", StateMachine::Private::warningCallback);
-    registerCFunction("errorCallback", StateMachine::Private::errorCallback);
-    registerCFunction("infoCallback", StateMachine::Private::infoCallback);
-
-    if(Utils::dostring(L, RFSM_NULL_FUNCTION_CHUNK, "RFSM_NULL_FUNCTION_CHANK") != LUA_OK)
-        return false;
-    if(Utils::dostring(L, EVENT_RETREIVE_CHUNK, "EVENT_RETREIVE_CHUNK") != LUA_OK)
-        return false;
-    if(Utils::dostring(L, SET_STATE_CALLBACKS_CHUNK, "SET_STATE_CALLBACKS_CHUNK") != LUA_OK)
-        return false;
-    if(Utils::dostring(L, GET_CURRENT_STATE_CHUNK, "GET_CURRENT_STATE_CHUNK") != LUA_OK)
-        return false;
-    if(Utils::dostring(L, GET_ALL_STATES_CHUNK, "GET_ALL_STATES_CHUNK") != LUA_OK)
-        return false;
-    if(Utils::dostring(L, GET_ALL_TRANSITIONS_CHUNK, "GET_ALL_TRANSITIONS_CHUNK") != LUA_OK)
-        return false;
-    if(Utils::dostring(L, GET_EVET_QUEUE_CHUNK, "GET_EVET_QUEUE_CHUNK") != LUA_OK)
-        return false;
-    if(Utils::dostring(L, PRE_STEP_HOOK_CHUNK, "PRE_STEP_HOOK_CHUNK") != LUA_OK)
-        return false;
-    if(Utils::dostring(L, POST_STEP_HOOK_CHUNK, "POST_STEP_HOOK_CHUNK") != LUA_OK)                
+// creates the lua state and loads the rfsm package
+bool StateMachine::Private::openState(rfsm::LuaTraceCallback* callback) {
+    memory = rfsm::MemoryStats();
+    L = lua_newstate(StateMachine::Private::allocate, this);
+    // 64 bit LuaJIT (without GC64) does not accept a custom allocator
+    if(L==NULL && allocator==NULL && memoryLimit==0) {
+        yWarning()<<"The lua memory accounting is not supported by this lua engine"<<ENDL;
+        L = luaL_newstate();
+    }
+    if(L==NULL) {
+        yError()<<"Cannot initialize lua! (lua_newstate)"<<ENDL;
         return false;
-    if(Utils::dostring(L, RFSM_PACK_ARGS_CHUNK, "RFSM_PACK_ARGS_CHUNK") != LUA_OK)
+    }
+    lua_atpanic(L, StateMachine::Private::panic);
+    applyGCMode();
+    trace = callback;
+
+    // the state is set up in protected mode, a memory limit below
+    // the footprint of the rfsm engine makes it fail cleanly
+    const string command = "package.path=package.path .. '" + luaPackagePath + "'";
+    return protect([this, callback, &command]() -> bool {
+        luaL_openlibs(L);
+        Utils::setLuaTraceCallback(L, callback);
+
+        // keep a single instance of the traceback handler for the protected calls
+        lua_pushcfunction(L, Utils::traceback);
+        tracebackRef = luaL_ref(L, LUA_REGISTRYINDEX);
+
+        // setting user-defined lua package paths
+        if(luaPackagePath.size() && Utils::dostring(L, command.c_str(), "command", !realTimeGC) != LUA_OK)
+            yWarning()<<"Could not set lua package path from"<<luaPackagePath<<ENDL;
+
+        // loading rfsm package
+#ifdef WITH_EMBEDDED_RFSM
+        if(Utils::dobuffer(L, gen_rfsm_utils_res, gen_rfsm_utils_res_len - 1, "gen_rfsm_utils_res", !realTimeGC) != LUA_OK)
             return false;
-    if(Utils::dostring(L, RFSM_WARNING_CHUNK, "RFSM_WARNING_CHUNK") != LUA_OK)
-        return false;
-    if(Utils::dostring(L, RFSM_ERROR_CHUNK, "RFSM_ERROR_CHUNK") != LUA_OK)
+        if(instrumented) {
+            if(Utils::dobuffer(L, gen_rfsm_res, gen_rfsm_res_len - 1, "gen_rfsm_res", !realTimeGC) != LUA_OK)
+                return false;
+        }
+        else if(Utils::dobuffer(L, gen_rfsm_release_res, gen_rfsm_release_res_len - 1, "gen_rfsm_release_res", !realTimeGC) != LUA_OK)
+            return false;
+#else
+        if (Utils::dolibrary(L, "rfsm") != LUA_OK)
+            return false;
+#endif
+
+        // registering some utility fuctions in lua
+        return registerAuxiliaryFunctions();
+    });
+}
+
+// initializes the fsm model on top of the stack (popped) and hooks it
+// to the owner. rfsm.init() returns false if the fsm cannot be initialized,
+// in that case the state machine stays unloaded as it used to be.
+bool StateMachine::Private::initModel(StateMachine* owner, bool verbose, bool trusted) {
+    // setting verbosity mode
+    setPrinters(lua_gettop(L), owner, verbose);
+
+    lua_getglobal(L, "rfsm");
+    lua_getfield(L, -1, "init");
+    lua_remove(L, -2);
+    lua_insert(L, -2);
+    lua_pushboolean(L, trusted);
+    if(pcall(2, 1) != LUA_OK)
         return false;
-    if(Utils::dostring(L, RFSM_INFO_CHUNK, "RFSM_INFO_CHUNK") != LUA_OK)
+    if(lua_istable(L, -1))
+        fsmRef = luaL_ref(L, LUA_REGISTRYINDEX);
+    else
+        lua_pop(L, 1);
+
+    // caching the rfsm functions called on every step and
+    // hooking the fsm
+    if(!attach(owner))
         return false;
+
+    // getting all availabe events, the state graph is
+    // extracted by the first stateGraph()
+    if(!getAllEvents())
+        yWarning()<<"Cannot retrieve all events"<<ENDL;
     return true;
 }
 
+// installs the loader of the model cache, the hash of the loaded files
+// starts from the engine
+bool StateMachine::Private::registerModelCache() {
+    cacheKey = engineHash();
+    lua_getglobal(L, "rfsm_install_model_cache");
+    lua_pushlightuserdata(L, this);
+    lua_pushcclosure(L, StateMachine::Private::cachedLoadfile, 1);
+    return (pcall(1, 0) == LUA_OK);
+}
+
+std::string StateMachine::Private::cachePath(uint64_t key, const char* extension) {
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx", (unsigned long long) key);
+    return cacheDirectory + name + extension;
+}
+
+// loads the compiled chunk of a lua file from the model cache or compiles
+// the file and stores its chunk. The chunks are keyed by the hash of the
+// file content and of the lua engine. The errors are raised once the C++
+// objects have been destroyed
+int StateMachine::Private::cachedLoadfile(lua_State* L) {
+    Private* priv = static_cast<Private*>(lua_touserdata(L, lua_upvalueindex(1)));
+    const char* filename = luaL_checkstring(L, 1);
+    // pushes the chunk or, on errors other than LUA_ERRFILE, the message
+    int status = [&]() -> int {
+        std::string source;
+        if(!readFile(filename, source))
+            return LUA_ERRFILE;
+        uint64_t key = hashBuffer(source.data(), source.size(), engineHash());
+        priv->cacheKey = hashBuffer(&key, sizeof(key), priv->cacheKey);
+
+        std::string path = priv->cachePath(key, ".luac");
+        std::string chunkname = std::string("@") + filename;
+        std::string chunk;
+        if(readFile(path, chunk)) {
+            if(luaL_loadbuffer(L, chunk.data(), chunk.size(), chunkname.c_str()) == LUA_OK)
+                return LUA_OK;
+            yWarning()<<"Cannot load the cached chunk"<<path<<ENDL;
+            lua_pop(L, 1);
+        }
+
+        // luaL_loadfile() skips the first line if it starts with '#'
+        if(source.size() && source[0] == '#')
+            source.insert(0, "--");
+        int loaded = luaL_loadbuffer(L, source.data(), source.size(), chunkname.c_str());
+        if(loaded != LUA_OK)
+            return loaded;
+        chunk.clear();
+#if LUA_VERSION_NUM >= 503
+        int dumped = lua_dump(L, writeChunk, &chunk, 0);
+#else
+        int dumped = lua_dump(L, writeChunk, &chunk);
+#endif
+        if(dumped != 0 || !writeFile(path, chunk))
+            yWarning()<<"Cannot write the cached chunk"<<path<<ENDL;
+        return LUA_OK;
+    }();
+    if(status == LUA_ERRFILE)
+        return luaL_error(L, "cannot open %s", filename);
+    if(status != LUA_OK)
+        return lua_error(L);
+    return 1;
+}
+
+bool StateMachine::Private::registerAuxiliaryFunctions() {
+#ifdef WITH_EMBEDDED_RFSM
+    return (Utils::dobuffer(L, gen_rfsm_aux_res, gen_rfsm_aux_res_len - 1, "RFSM_AUXILIARY_CHUNK", !realTimeGC) == LUA_OK);
+#else
+    return (Utils::dostring(L, RFSM_AUXILIARY_CHUNK, "RFSM_AUXILIARY_CHUNK", !realTimeGC) == LUA_OK);
+#endif
+}
+
 bool StateMachine::Private::getAllEvents() {
     if(!isrFSMLoaded())
         return false;
     events.clear();
-    if(Utils::dostring(L, "events = rfsm_get_all_events()", "EVENT_RETREIVE_CHUNK") != LUA_OK)
+    eventIndex.clear();
+    lua_getglobal(L, "rfsm_get_all_events");
+    lua_rawgeti(L, LUA_REGISTRYINDEX, fsmRef);
+    if(pcall(1, 1) != LUA_OK)
         return false;
-    lua_getglobal(L, "events");
     if(!lua_istable(L, -1)) {
         yError()<<"got the wrong value from rfsm_get_all_events()"<<ENDL;
+        lua_pop(L, 1);
         return false;
     }
-    lua_pushnil(L);
-    while(lua_next(L, -2) != 0) {
-        if(lua_isstring(L, -1))
-            events.push_back(lua_tostring(L, -1));
+    int n = lua_objlen(L, -1);
+    for(int i=1; i<=n; i++) {
+        lua_rawgeti(L, -1, i);
+        if(lua_isstring(L, -1)) {
+            const char* event = lua_tostring(L, -1);
+            if(!eventIndex.insert(std::make_pair(eventHash(event), (EventId) events.size())).second)
+                yWarning()<<"Event"<<event<<"has the same hash of another event"<<ENDL;
+            events.push_back(event);
+        }
         else
             yWarning()<<"found a wrong type in the result from rfsm_get_all_events()"<<ENDL;
        lua_pop(L, 1);
     }
+    // the table of event names is indexed by EventId+1
+    eventsRef = luaL_ref(L, LUA_REGISTRYINDEX);
     return true;
 }
 
+// extracts the state graph once, it walks the whole fsm
+// and calls debug.getinfo() on every state function
+const rfsm::StateGraph& StateMachine::Private::stateGraph() {
+    if(!graphLoaded && isrFSMLoaded()) {
+        graphLoaded = true;
+        if(!protect([this]() -> bool { return getAllStateGraph(); }))
+            yWarning()<<"Cannot retrieve state graph"<<ENDL;
+    }
+    return graph;
+}
+
 bool StateMachine::Private::getAllStateGraph() {
     if(!isrFSMLoaded())
         return false;
@@ -689,10 +1692,12 @@ bool StateMachine::Private::getAllStateGraph() {
     lua_getglobal(L, "rfsm_get_all_states");
     if(!lua_isfunction(L, -1)) {
         yError()<<"StateMachine::getAllStateGraph() could not find rfsm_get_all_states()"<<ENDL;
+        lua_pop(L, 1);
         return false;
     }
 
-    if(lua_pcall(L, 0, 1, 0) != 0) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, fsmRef);
+    if(lua_pcall(L, 1, 1, 0) != 0) {
         yError()<<"StateMachine::getAllStateGraph()"<<lua_tostring(L, -1)<<ENDL;
         lua_pop(L, 1);
         return false;
@@ -738,10 +1743,12 @@ bool StateMachine::Private::getAllStateGraph() {
     lua_getglobal(L, "rfsm_get_all_transitions");
     if(!lua_isfunction(L, -1)) {
         yError()<<"StateMachine::getAllStateGraph() could not find rfsm_get_all_transitions()"<<ENDL;
+        lua_pop(L, 1);
         return false;
     }
 
-    if(lua_pcall(L, 0, 1, 0) != 0) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, fsmRef);
+    if(lua_pcall(L, 1, 1, 0) != 0) {
         yError()<<"StateMachine::getAllStateGraph()"<<lua_tostring(L, -1)<<ENDL;
         lua_pop(L, 1);
         return false;
@@ -780,13 +1787,530 @@ bool StateMachine::Private::getAllStateGraph() {
     return true;
 }
 
+int StateMachine::Private::getFunctionRef(const char* table, const char* name) {
+    lua_getglobal(L, table);
+    if(!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        yError()<<"StateMachine::getFunctionRef() could not find"<<table<<ENDL;
+        return LUA_NOREF;
+    }
+    lua_getfield(L, -1, name);
+    if(!lua_isfunction(L, -1)) {
+        lua_pop(L, 2);
+        yError()<<"StateMachine::getFunctionRef() could not find"<<table<<"."<<name<<"()"<<ENDL;
+        return LUA_NOREF;
+    }
+    int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_pop(L, 1);
+    return ref;
+}
+
+bool StateMachine::Private::resolveReferences() {
+    sendEventsRef = getFunctionRef("rfsm", "send_events");
+    stepRef = getFunctionRef("rfsm", "step");
+    runRef = getFunctionRef("rfsm", "run");
+    if(sendEventsRef == LUA_NOREF || stepRef == LUA_NOREF || runRef == LUA_NOREF)
+        return false;
+    lua_pushcfunction(L, StateMachine::Private::pushEvents);
+    pushEventsRef = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_pushcfunction(L, StateMachine::Private::sendEventString);
+    sendEventRef = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_pushcfunction(L, StateMachine::Private::pushEventIds);
+    pushEventIdsRef = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_pushcfunction(L, StateMachine::Private::stepMachine);
+    stepMachineRef = luaL_ref(L, LUA_REGISTRYINDEX);
+    lua_pushcfunction(L, StateMachine::Private::runMachine);
+    runMachineRef = luaL_ref(L, LUA_REGISTRYINDEX);
+    return true;
+}
+
+// caches the rfsm functions and, if the fsm is initialized,
+// hooks it to the owner
+bool StateMachine::Private::attach(StateMachine* owner) {
+    if(!resolveReferences())
+        return false;
+    if(fsmRef == LUA_NOREF)
+        return true;
+    // merging the posted events into the rfsm queue
+    if(!registerGetEvents())
+        return false;
+    // searching the enabled transitions natively
+    if(!registerFindEnabled())
+        return false;
+    // tracking the active configuration
+    return indexStates() && registerStateHooks(owner);
+}
+
+bool StateMachine::Private::registerGetEvents() {
+    delete postedEvents;
+    postedEvents = new rfsm::ConcurrentEventQueue(postQueueSize);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, fsmRef);
+    lua_pushlightuserdata(L, this);
+    lua_getfield(L, -2, "getevents");
+    if(!lua_isfunction(L, -1)) {
+        yError()<<"StateMachine::registerGetEvents() could not find fsm.getevents()"<<ENDL;
+        lua_pop(L, 3);
+        return false;
+    }
+    lua_pushcclosure(L, StateMachine::Private::getEvents, 2);
+    lua_setfield(L, -2, "getevents");
+    lua_pop(L, 1);
+    return true;
+}
+
+// sets the _cid of the states and builds the state index
+bool StateMachine::Private::indexStates() {
+    stateNames.clear();
+    stateIndex.clear();
+    stateDepth.clear();
+    stateLeaf.clear();
+    activeChain.clear();
+    activeLeaf = -1;
+
+    lua_getglobal(L, "rfsm_index_states");
+    lua_rawgeti(L, LUA_REGISTRYINDEX, fsmRef);
+    if(pcall(1, 2) != LUA_OK)
+        return false;
+    if(!lua_istable(L, -1) || !lua_istable(L, -2)) {
+        yError()<<"got the wrong value from rfsm_index_states()"<<ENDL;
+        lua_pop(L, 2);
+        return false;
+    }
+    // the state tables indexed by StateId+1
+    statesRef = luaL_ref(L, LUA_REGISTRYINDEX);
+    int n = lua_objlen(L, -1);
+    for(int i=1; i<=n; i++) {
+        lua_rawgeti(L, -1, i);
+        lua_rawgeti(L, -1, 1);
+        lua_rawgeti(L, -2, 2);
+        std::string name = lua_isstring(L, -2) ? lua_tostring(L, -2) : "";
+        bool leaf = (lua_toboolean(L, -1) == 1);
+        lua_pop(L, 3);
+        // depth in the active configuration (root.A is the first one)
+        size_t depth = std::count(name.begin(), name.end(), '.');
+        if(name.compare(0, 5, "root.") == 0)
+            name.erase(0, 5);
+        stateIndex[name] = (StateId) stateNames.size();
+        stateNames.push_back(name);
+        stateDepth.push_back((depth > 0) ? depth - 1 : 0);
+        stateLeaf.push_back(leaf);
+    }
+    lua_pop(L, 1);
+    return true;
+}
+
+bool StateMachine::Private::registerStateHooks(StateMachine* owner) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, fsmRef);
+    lua_pushlightuserdata(L, owner);
+    lua_pushcclosure(L, StateMachine::Private::enterHook, 1);
+    lua_setfield(L, -2, "_enter_hook");
+    lua_pushlightuserdata(L, owner);
+    lua_pushcclosure(L, StateMachine::Private::exitHook, 1);
+    lua_setfield(L, -2, "_exit_hook");
+    lua_pop(L, 1);
+    return true;
+}
+
+// compiles the dispatch tables of the fsm and installs fsm._find_enabled
+// with the nodes, the transitions and the event bits as upvalues
+bool StateMachine::Private::registerFindEnabled() {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, fsmRef);
+    lua_getglobal(L, "rfsm_dispatch_tables");
+    lua_pushvalue(L, -2);
+    if(pcall(1, 5) != LUA_OK) {
+        lua_pop(L, 1);
+        return false;
+    }
+    if(!lua_istable(L, -2) || !lua_isnumber(L, -1)) {
+        yError()<<"got the wrong value from rfsm_dispatch_tables()"<<ENDL;
+        lua_pop(L, 6);
+        return false;
+    }
+    eventWords = ((size_t) lua_tointeger(L, -1) + 63) / 64;
+    queuedEvents.assign(eventWords, 0);
+    dispatch.clear();
+    int nodes = (int) lua_objlen(L, -2);
+    dispatch.resize(nodes);
+    for(int i=1; i<=nodes; i++) {
+        DispatchNode& node = dispatch[i-1];
+        node.events.assign(eventWords, 0);
+        lua_rawgeti(L, -2, i);
+        int n = (int) lua_objlen(L, -1);
+        node.transitions.resize(n);
+        for(int j=1; j<=n; j++) {
+            DispatchTransition& tr = node.transitions[j-1];
+            lua_rawgeti(L, -1, j);
+            lua_rawgeti(L, -1, 1);
+            lua_rawgeti(L, -2, 2);
+            lua_rawgeti(L, -3, 3);
+            tr.trans = (int) lua_tointeger(L, -3);
+            tr.target = (int) lua_tointeger(L, -2);
+            tr.kind = (int) lua_tointeger(L, -1);
+            lua_pop(L, 3);
+            lua_rawgeti(L, -1, 4);
+            tr.eventless = !lua_istable(L, -1);
+            tr.events.assign(eventWords, 0);
+            if(tr.eventless)
+                node.eventless = true;
+            else {
+                int nevents = (int) lua_objlen(L, -1);
+                for(int k=1; k<=nevents; k++) {
+                    lua_rawgeti(L, -1, k);
+                    size_t bit = (size_t) lua_tointeger(L, -1);
+                    lua_pop(L, 1);
+                    tr.events[bit / 64] |= (uint64_t) 1 << (bit % 64);
+                    node.events[bit / 64] |= (uint64_t) 1 << (bit % 64);
+                }
+            }
+            lua_pop(L, 2);
+        }
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 2);
+    // stack: fsm, nodes, trans, bits
+    lua_pushlightuserdata(L, this);
+    lua_insert(L, -4);
+    lua_pushcclosure(L, StateMachine::Private::findEnabled, 4);
+    lua_setfield(L, -2, "_find_enabled");
+    lua_pop(L, 1);
+    return true;
+}
+
+bool StateMachine::Private::step(const char* event, EventId id, lua_Number n, StepResult* result) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, stepMachineRef);
+    lua_pushlightuserdata(L, this);
+    lua_pushlightuserdata(L, result);
+    lua_pushnumber(L, n);
+    if(event)
+        lua_pushlightuserdata(L, (void*) event);
+    else if(id != InvalidEventId) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, eventsRef);
+        lua_rawgeti(L, -1, id + 1);
+        lua_remove(L, -2);
+    }
+    else
+        lua_pushnil(L);
+    return (pcall(4, 0) == LUA_OK);
+}
+
+// the fsm table is at the given stack index
+void StateMachine::Private::resetStepCounters(int fsm) {
+    lua_pushinteger(L, 0);
+    lua_setfield(L, fsm, "_nsteps");
+    lua_pushinteger(L, 0);
+    lua_setfield(L, fsm, "_ntrans");
+}
+
+// fills everything but result.idle, leaves the stack untouched
+void StateMachine::Private::getStepResult(int fsm, StepResult& result) {
+    lua_getfield(L, fsm, "_nsteps");
+    result.steps = (unsigned int) lua_tointeger(L, -1);
+    lua_getfield(L, fsm, "_ntrans");
+    result.transitions = (unsigned int) lua_tointeger(L, -1);
+    lua_getfield(L, fsm, "_intq");
+    result.queueDepth = lua_istable(L, -1) ? lua_objlen(L, -1) : 0;
+    lua_pop(L, 3);
+    result.state = activeChain.empty() ? InvalidStateId : activeChain.back();
+}
+
+/**
+ * calls the function placed under its narg arguments on top of the stack
+ * using the cached traceback function as the error handler. Only the call
+ * is protected: the function and its arguments must be pushed without
+ * allocating (registry references, light userdata, numbers), the other
+ * code runs through protect()
+ */
+int StateMachine::Private::pcall(int narg, int nresults) {
+    int base = lua_gettop(L) - narg;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, tracebackRef);
+    lua_insert(L, base);
+    int status = lua_pcall(L, narg, nresults, base);
+    lua_remove(L, base);
+    if (status != 0 && !realTimeGC) lua_gc(L, LUA_GCCOLLECT, 0);
+    return Utils::report(L, status, trace);
+}
+
 void StateMachine::Private::close() {
-    if(L){
-        lua_close(L);
-        L = NULL;
+    // the hosted machines cannot outlive the lua state
+    std::vector<Private*> hosted;
+    hosted.swap(guests);
+    for(size_t i=0; i<hosted.size(); i++) {
+        hosted[i]->host = NULL;
+        hosted[i]->close();
+    }
+    nextGuest = 0;
+    if(host) {
+        host->guests.erase(std::remove(host->guests.begin(), host->guests.end(), this),
+                           host->guests.end());
+        host = NULL;
     }
-    luaFuncReg.clear();
-    callbacks.clear();
+    footprint = 0;
+    gcStats = rfsm::GCStats();
+
+    // a shared lua state is left to its template, only the references
+    // of this instance are released
+    int* refs[] = { &tracebackRef, &fsmRef, &sendEventsRef, &sendEventRef, &stepRef, &runRef,
+                    &pushEventsRef, &pushEventIdsRef, &eventsRef, &stepMachineRef,
+                    &statesRef, &runMachineRef };
+    for(size_t i=0; i<sizeof(refs)/sizeof(refs[0]); i++) {
+        if(L && sharedState)
+            luaL_unref(L, LUA_REGISTRYINDEX, *refs[i]);
+        *refs[i] = LUA_NOREF;
+    }
+    if(L && !sharedState)
+        lua_close(L);
+    L = NULL;
+    sharedState = false;
+    trace = NULL;
+    delete postedEvents;
+    postedEvents = NULL;
     graph.clear();
+    graphLoaded = false;
     events.clear();
+    eventIndex.clear();
+    stateNames.clear();
+    stateIndex.clear();
+    stateDepth.clear();
+    stateLeaf.clear();
+    activeChain.clear();
+    activeLeaf = -1;
+}
+
+
+/**********************************************************
+* class StateMachineTemplate
+***********************************************************/
+StateMachineTemplate::StateMachineTemplate() : mPriv(new StateMachine::Private()) { }
+
+StateMachineTemplate::~StateMachineTemplate() {
+    close();
+    delete mPriv;
+}
+
+void StateMachineTemplate::close() {
+    mPriv->close();
+}
+
+const std::string StateMachineTemplate::getFileName() {
+    return mPriv->fileName;
+}
+
+void StateMachineTemplate::addLuaPackagePath(const std::string& path) {
+    mPriv->luaPackagePath += string(";")+path;
+}
+
+const std::vector<std::string>& StateMachineTemplate::getEventsList() {
+    return mPriv->events;
+}
+
+const rfsm::StateGraph& StateMachineTemplate::getStateGraph() {
+    return mPriv->stateGraph();
+}
+
+bool StateMachineTemplate::load(const std::string& filename) {
+    close();
+    mPriv->fileName = filename;
+    if(!mPriv->openState(NULL)) {
+        close();
+        return false;
+    }
+    lua_State* L = mPriv->L;
+
+    bool loaded = mPriv->protect([&]() -> bool {
+        // loading rfsm state machine
+        lua_getglobal(L, "rfsm");
+        lua_getfield(L, -1, "load");
+        lua_remove(L, -2);
+        lua_pushstring(L, filename.c_str());
+        if(mPriv->pcall(1, 1) != LUA_OK)
+            return false;
+
+        // the instances set their own printers
+        lua_getglobal(L, "rfsm_null_func");
+        lua_setfield(L, -2, "warn");
+        lua_getglobal(L, "rfsm_null_func");
+        lua_setfield(L, -2, "info");
+
+        // initializing rfsm state machine. it is never stepped
+        // and its hooks are not set
+        lua_getglobal(L, "rfsm");
+        lua_getfield(L, -1, "init");
+        lua_remove(L, -2);
+        lua_insert(L, -2);
+        if(mPriv->pcall(1, 1) != LUA_OK)
+            return false;
+        if(!lua_istable(L, -1)) {
+            yError()<<"Cannot initialize"<<filename<<ENDL;
+            return false;
+        }
+        mPriv->fsmRef = luaL_ref(L, LUA_REGISTRYINDEX);
+
+        // the state index and the events are shared by the instances
+        return mPriv->indexStates() && mPriv->getAllEvents();
+    });
+    if(!loaded) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+bool StateMachineTemplate::instantiate(rfsm::StateMachine& machine) {
+    machine.close();
+    if(!mPriv->isrFSMLoaded())
+        return false;
+    lua_State* L = mPriv->L;
+    StateMachine::Private* priv = machine.mPriv;
+    priv->host = mPriv;
+    mPriv->guests.push_back(priv);
+    bool instantiated = mPriv->protect([&]() -> bool {
+        // copying the initialized fsm along with its state tables
+        lua_getglobal(L, "rfsm_instantiate");
+        lua_rawgeti(L, LUA_REGISTRYINDEX, mPriv->fsmRef);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, mPriv->statesRef);
+        if(mPriv->pcall(2, 2) != LUA_OK)
+            return false;
+        if(!lua_istable(L, -1) || !lua_istable(L, -2)) {
+            yError()<<"got the wrong value from rfsm_instantiate()"<<ENDL;
+            return false;
+        }
+
+        priv->L = L;
+        priv->sharedState = true;
+        priv->trace = (rfsm::LuaTraceCallback*) &machine;
+        priv->fileName = mPriv->fileName;
+        lua_pushcfunction(L, Utils::traceback);
+        priv->tracebackRef = luaL_ref(L, LUA_REGISTRYINDEX);
+        priv->statesRef = luaL_ref(L, LUA_REGISTRYINDEX);
+        priv->setPrinters(lua_gettop(L), &machine, machine.verbose);
+        priv->fsmRef = luaL_ref(L, LUA_REGISTRYINDEX);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, mPriv->eventsRef);
+        priv->eventsRef = luaL_ref(L, LUA_REGISTRYINDEX);
+        priv->events = mPriv->events;
+        priv->eventIndex = mPriv->eventIndex;
+        // the state graph is shared only if it has been already extracted
+        priv->graph = mPriv->graph;
+        priv->graphLoaded = mPriv->graphLoaded;
+        priv->stateNames = mPriv->stateNames;
+        priv->stateIndex = mPriv->stateIndex;
+        priv->stateDepth = mPriv->stateDepth;
+        priv->stateLeaf = mPriv->stateLeaf;
+
+        // the dispatch tables refer to the copied nodes, thus they
+        // are built for each instance
+        return priv->resolveReferences() && priv->registerGetEvents() &&
+               priv->registerFindEnabled() && priv->registerStateHooks(&machine);
+    });
+    if(!instantiated) {
+        machine.close();
+        return false;
+    }
+    return true;
+}
+
+
+/**********************************************************
+* class StateMachineHost
+***********************************************************/
+// the memory used by the lua state in bytes
+static size_t getLuaMemory(lua_State* L) {
+    return (size_t) lua_gc(L, LUA_GCCOUNT, 0) * 1024 + (size_t) lua_gc(L, LUA_GCCOUNTB, 0);
+}
+
+// the live bytes of the allocator or, without memory accounting,
+// the memory reported by lua
+size_t StateMachine::Private::usedMemory() {
+    return (memory.liveBytes) ? memory.liveBytes : getLuaMemory(L);
+}
+
+StateMachineHost::StateMachineHost() : mPriv(new StateMachine::Private()) { }
+
+StateMachineHost::~StateMachineHost() {
+    close();
+    delete mPriv;
+}
+
+void StateMachineHost::close() {
+    mPriv->close();
+}
+
+void StateMachineHost::addLuaPackagePath(const std::string& path) {
+    mPriv->luaPackagePath += string(";")+path;
+}
+
+bool StateMachineHost::open() {
+    close();
+    if(!mPriv->openState(NULL)) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+bool StateMachineHost::load(rfsm::StateMachine& machine, const std::string& filename) {
+    machine.close();
+    CHECK_LUA_INITIALIZED(mPriv->L);
+    lua_State* L = mPriv->L;
+    // the footprint is measured without collecting the garbage, whose
+    // cost would grow with the number of the hosted machines
+    size_t memory = mPriv->usedMemory();
+
+    StateMachine::Private* priv = machine.mPriv;
+    priv->L = L;
+    priv->sharedState = true;
+    priv->trace = (rfsm::LuaTraceCallback*) &machine;
+    priv->fileName = filename;
+    priv->host = mPriv;
+    mPriv->guests.push_back(priv);
+    bool loaded = priv->protect([&]() -> bool {
+        lua_pushcfunction(L, Utils::traceback);
+        priv->tracebackRef = luaL_ref(L, LUA_REGISTRYINDEX);
+
+        // loading rfsm state machine in its own environment
+        lua_getglobal(L, "rfsm_load_isolated");
+        lua_pushstring(L, filename.c_str());
+        return (priv->pcall(1, 1) == LUA_OK) && priv->initModel(&machine, machine.verbose);
+    });
+    if(!loaded) {
+        machine.close();
+        return false;
+    }
+
+    size_t used = mPriv->usedMemory();
+    priv->footprint = (used > memory) ? used - memory : 0;
+    return true;
+}
+
+bool StateMachineHost::step(unsigned int n) {
+    CHECK_LUA_INITIALIZED(mPriv->L);
+    bool result = true;
+    for(size_t i=0; i<mPriv->guests.size(); i++) {
+        if(mPriv->guests[i]->fsmRef != LUA_NOREF)
+            result &= mPriv->guests[i]->step(NULL, InvalidEventId, n, NULL);
+    }
+    return result;
+}
+
+bool StateMachineHost::stepNext(unsigned int n) {
+    CHECK_LUA_INITIALIZED(mPriv->L);
+    if(mPriv->guests.empty())
+        return false;
+    if(mPriv->nextGuest >= mPriv->guests.size())
+        mPriv->nextGuest = 0;
+    StateMachine::Private* priv = mPriv->guests[mPriv->nextGuest++];
+    if(priv->fsmRef == LUA_NOREF)
+        return false;
+    return priv->step(NULL, InvalidEventId, n, NULL);
+}
+
+size_t StateMachineHost::getMachineCount() {
+    return mPriv->guests.size();
+}
+
+size_t StateMachineHost::getMemoryUsage() {
+    return (mPriv->L) ? getLuaMemory(mPriv->L) : 0;
+}
+
+size_t StateMachineHost::getFootprint(const rfsm::StateMachine& machine) {
+    return (machine.mPriv->host == mPriv) ? machine.mPriv->footprint : 0;
 }
@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2017 iCub Facility
+ * Authors: Ali Paikan <ali.paikan@iit.it>, Nicolo' Genesio <nicolo.genesio@iit.it>
+ * CopyPolicy: Released under the terms of the LGPLv2.1 or later, see LGPL.TXT
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include <rfsm.h>
+
+using namespace std;
+using namespace rfsm;
+
+// the blocks up to MAX_POOLED_SIZE bytes are served by the pools
+#define POOL_GRANULARITY    16
+#define MAX_POOLED_SIZE     512
+#define POOL_CHUNK_SIZE     (64 * 1024)
+
+
+void* Allocator::reallocate(void* ptr, size_t oldSize, size_t newSize) {
+    void* block = allocate(newSize);
+    if(block == NULL)
+        return NULL;
+    memcpy(block, ptr, std::min(oldSize, newSize));
+    deallocate(ptr, oldSize);
+    return block;
+}
+
+
+class PoolAllocator::Private {
+public:
+    Private() : freeLists(MAX_POOLED_SIZE / POOL_GRANULARITY, (void*) NULL) { }
+
+    ~Private() {
+        for(size_t i=0; i<chunks.size(); i++)
+            free(chunks[i]);
+    }
+
+    // the index of the size class of a pooled block
+    static size_t sizeClass(size_t size) {
+        return (size - 1) / POOL_GRANULARITY;
+    }
+
+    // carves a new chunk into blocks of the given size class
+    bool refill(size_t index) {
+        size_t blockSize = (index + 1) * POOL_GRANULARITY;
+        char* chunk = static_cast<char*>(malloc(POOL_CHUNK_SIZE));
+        if(chunk == NULL)
+            return false;
+        chunks.push_back(chunk);
+        for(size_t offset = 0; offset + blockSize <= POOL_CHUNK_SIZE; offset += blockSize) {
+            *reinterpret_cast<void**>(chunk + offset) = freeLists[index];
+            freeLists[index] = chunk + offset;
+        }
+        return true;
+    }
+
+public:
+    // the free blocks of each size class are linked through their first word
+    std::vector<void*> freeLists;
+    std::vector<char*> chunks;
+};
+
+
+PoolAllocator::PoolAllocator() : mPriv(new Private()) { }
+
+PoolAllocator::~PoolAllocator() {
+    delete mPriv;
+}
+
+void* PoolAllocator::allocate(size_t size) {
+    if(size > MAX_POOLED_SIZE)
+        return malloc(size);
+    size_t index = Private::sizeClass(size);
+    if(mPriv->freeLists[index] == NULL && !mPriv->refill(index))
+        return NULL;
+    void* block = mPriv->freeLists[index];
+    mPriv->freeLists[index] = *static_cast<void**>(block);
+    return block;
+}
+
+void PoolAllocator::deallocate(void* ptr, size_t size) {
+    if(size > MAX_POOLED_SIZE) {
+        free(ptr);
+        return;
+    }
+    size_t index = Private::sizeClass(size);
+    *static_cast<void**>(ptr) = mPriv->freeLists[index];
+    mPriv->freeLists[index] = ptr;
+}
+
+void* PoolAllocator::reallocate(void* ptr, size_t oldSize, size_t newSize) {
+    if(oldSize > MAX_POOLED_SIZE && newSize > MAX_POOLED_SIZE)
+        return realloc(ptr, newSize);
+    if(oldSize <= MAX_POOLED_SIZE && newSize <= MAX_POOLED_SIZE &&
+       Private::sizeClass(oldSize) == Private::sizeClass(newSize))
+        return ptr;
+    return Allocator::reallocate(ptr, oldSize, newSize);
+}
@@ -0,0 +1,282 @@
+/*
+ * Copyright (C) 2017 iCub Facility
+ * Authors: Ali Paikan <ali.paikan@iit.it>, Nicolo' Genesio <nicolo.genesio@iit.it>
+ * CopyPolicy: Released under the terms of the LGPLv2.1 or later, see LGPL.TXT
+ */
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <rfsmUtils.h>
+#include <rfsmExecutor.h>
+
+using namespace std;
+using namespace rfsm;
+
+
+namespace {
+
+/**
+ * a state machine scheduled by the executor. The state tells whether
+ * it is waiting in the queue of a worker, running or woken up while
+ * running (to be scheduled again by its worker)
+ */
+struct Task {
+    enum { IDLE, QUEUED, RUNNING, RERUN };
+    Task(StateMachine* machine) : machine(machine), state(IDLE), removed(false) { }
+    StateMachine* machine;
+    std::atomic<int> state;
+    std::atomic<bool> removed;
+};
+
+typedef std::shared_ptr<Task> TaskPtr;
+
+struct Worker {
+    Worker() : tasks(0), steps(0), transitions(0), steals(0) { }
+    std::mutex mutex;
+    std::deque<TaskPtr> queue;
+    std::thread thread;
+    std::atomic<unsigned long long> tasks;
+    std::atomic<unsigned long long> steps;
+    std::atomic<unsigned long long> transitions;
+    std::atomic<unsigned long long> steals;
+};
+
+}
+
+
+class Executor::Private {
+public:
+    Private(unsigned int threads) : pending(0), running(false), nextWorker(0), wakeups(0),
+        maxSteps(100), budget(1000000) {
+        if(threads == 0)
+            threads = std::thread::hardware_concurrency();
+        if(threads == 0)
+            threads = 1;
+        for(unsigned int i=0; i<threads; i++)
+            workers.push_back(new Worker());
+    }
+
+    virtual ~Private() {
+        for(size_t i=0; i<workers.size(); i++)
+            delete workers[i];
+    }
+
+    TaskPtr find(StateMachine* machine);
+    bool wake(const TaskPtr& task);
+    void schedule(const TaskPtr& task, Worker* worker);
+    TaskPtr take(size_t self);
+    void execute(const TaskPtr& task, Worker* worker);
+    void run(size_t self);
+
+public:
+    std::vector<Worker*> workers;
+    std::mutex tasksMutex;
+    std::unordered_map<StateMachine*, TaskPtr> tasks;
+    // the workers sleep while there is no task in their queues
+    std::mutex sleepMutex;
+    std::condition_variable wakeup;
+    std::atomic<long> pending;
+    std::atomic<bool> running;
+    std::atomic<unsigned int> nextWorker;
+    std::atomic<unsigned long long> wakeups;
+    std::atomic<unsigned int> maxSteps;
+    std::atomic<long long> budget;
+};
+
+
+Executor::Executor(unsigned int threads) : mPriv(new Private(threads)) { }
+
+Executor::~Executor() {
+    stop();
+    delete mPriv;
+}
+
+bool Executor::start() {
+    if(mPriv->running.exchange(true))
+        return false;
+    for(size_t i=0; i<mPriv->workers.size(); i++)
+        mPriv->workers[i]->thread = std::thread(&Executor::Private::run, mPriv, i);
+    return true;
+}
+
+void Executor::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mPriv->sleepMutex);
+        if(!mPriv->running.exchange(false))
+            return;
+    }
+    mPriv->wakeup.notify_all();
+    for(size_t i=0; i<mPriv->workers.size(); i++) {
+        if(mPriv->workers[i]->thread.joinable())
+            mPriv->workers[i]->thread.join();
+    }
+}
+
+bool Executor::add(rfsm::StateMachine& machine) {
+    // the first getStateGraph() runs lua code, it cannot be done by
+    // the caller once the workers run the machine
+    machine.getStateGraph();
+    TaskPtr task(new Task(&machine));
+    {
+        std::lock_guard<std::mutex> lock(mPriv->tasksMutex);
+        if(!mPriv->tasks.insert(std::make_pair(&machine, task)).second) {
+            yWarning()<<"Executor::add() the state machine has been already added"<<ENDL;
+            return false;
+        }
+    }
+    // the first run enters the initial state
+    return mPriv->wake(task);
+}
+
+bool Executor::remove(rfsm::StateMachine& machine) {
+    TaskPtr task;
+    {
+        std::lock_guard<std::mutex> lock(mPriv->tasksMutex);
+        std::unordered_map<StateMachine*, TaskPtr>::iterator itr = mPriv->tasks.find(&machine);
+        if(itr == mPriv->tasks.end())
+            return false;
+        task = itr->second;
+        mPriv->tasks.erase(itr);
+    }
+    // a queued task is dropped by the worker which takes it
+    task->removed = true;
+    while(task->state == Task::RUNNING || task->state == Task::RERUN)
+        std::this_thread::yield();
+    return true;
+}
+
+bool Executor::wake(rfsm::StateMachine& machine) {
+    TaskPtr task = mPriv->find(&machine);
+    return task && mPriv->wake(task);
+}
+
+bool Executor::postEvent(rfsm::StateMachine& machine, const std::string& event) {
+    return machine.postEvent(event) && wake(machine);
+}
+
+bool Executor::postEvent(rfsm::StateMachine& machine, EventId event) {
+    return machine.postEvent(event) && wake(machine);
+}
+
+void Executor::setTaskBudget(unsigned int maxSteps, std::chrono::nanoseconds budget) {
+    mPriv->maxSteps = maxSteps;
+    mPriv->budget = budget.count();
+}
+
+rfsm::ExecutorStats Executor::getStats() {
+    ExecutorStats stats;
+    for(size_t i=0; i<mPriv->workers.size(); i++) {
+        stats.tasks += mPriv->workers[i]->tasks;
+        stats.steps += mPriv->workers[i]->steps;
+        stats.transitions += mPriv->workers[i]->transitions;
+        stats.steals += mPriv->workers[i]->steals;
+    }
+    stats.wakeups = mPriv->wakeups;
+    return stats;
+}
+
+
+/**********************************************************
+* class Executor::Private
+***********************************************************/
+TaskPtr Executor::Private::find(StateMachine* machine) {
+    std::lock_guard<std::mutex> lock(tasksMutex);
+    std::unordered_map<StateMachine*, TaskPtr>::const_iterator itr = tasks.find(machine);
+    return (itr != tasks.end()) ? itr->second : TaskPtr();
+}
+
+// queues an idle task or marks a running one to be run again
+bool Executor::Private::wake(const TaskPtr& task) {
+    int state = task->state;
+    for(;;) {
+        if(state == Task::QUEUED || state == Task::RERUN)
+            return true;
+        int next = (state == Task::IDLE) ? Task::QUEUED : Task::RERUN;
+        if(task->state.compare_exchange_weak(state, next))
+            break;
+    }
+    wakeups++;
+    if(state == Task::IDLE)
+        schedule(task, workers[nextWorker++ % workers.size()]);
+    return true;
+}
+
+void Executor::Private::schedule(const TaskPtr& task, Worker* worker) {
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        pending++;
+    }
+    {
+        std::lock_guard<std::mutex> lock(worker->mutex);
+        worker->queue.push_back(task);
+    }
+    wakeup.notify_one();
+}
+
+// takes the oldest task of the worker or steals the newest one of the others
+TaskPtr Executor::Private::take(size_t self) {
+    TaskPtr task;
+    Worker* worker = workers[self];
+    {
+        std::lock_guard<std::mutex> lock(worker->mutex);
+        if(!worker->queue.empty()) {
+            task = worker->queue.front();
+            worker->queue.pop_front();
+            return task;
+        }
+    }
+    for(size_t i=1; i<workers.size(); i++) {
+        Worker* victim = workers[(self + i) % workers.size()];
+        std::lock_guard<std::mutex> lock(victim->mutex);
+        if(!victim->queue.empty()) {
+            task = victim->queue.back();
+            victim->queue.pop_back();
+            worker->steals++;
+            return task;
+        }
+    }
+    return task;
+}
+
+void Executor::Private::execute(const TaskPtr& task, Worker* worker) {
+    task->state = Task::RUNNING;
+    if(task->removed) {
+        task->state = Task::IDLE;
+        return;
+    }
+    StepResult result;
+    bool done = !task->machine->runFor(maxSteps, std::chrono::nanoseconds(budget), result) || result.idle;
+    worker->tasks++;
+    worker->steps += result.steps;
+    worker->transitions += result.transitions;
+    if(task->removed) {
+        task->state = Task::IDLE;
+        return;
+    }
+    // the task goes back to the queue if it has still work to do
+    // or it has been woken up while running
+    int state = Task::RUNNING;
+    if(done && task->state.compare_exchange_strong(state, Task::IDLE))
+        return;
+    task->state = Task::QUEUED;
+    schedule(task, worker);
+}
+
+void Executor::Private::run(size_t self) {
+    while(running) {
+        TaskPtr task = take(self);
+        if(!task) {
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            wakeup.wait(lock, [this] { return pending > 0 || !running; });
+            continue;
+        }
+        pending--;
+        execute(task, workers[self]);
+    }
+}
@@ -11,13 +11,15 @@
 
 using namespace rfsm;
 
-LuaTraceCallback* Utils::traceCallback = NULL;
+// the address of this variable is the registry key of the trace callback
+static const char traceCallbackKey = 0;
 
-int Utils::report (lua_State *L, int status) {
+int Utils::report (lua_State *L, int status, LuaTraceCallback* callback) {
   if (status && !lua_isnil(L, -1)) {
     const char *msg = lua_tostring(L, -1);
     std::string strMessage = (msg != NULL) ? msg : "(error object is not a string)";
     lua_pop(L, 1);
+    LuaTraceCallback* traceCallback = (callback) ? callback : getLuaTraceCallback(L);
     if(traceCallback)
         traceCallback->onTrace(strMessage);
     else
@@ -54,27 +56,35 @@ int Utils::traceback (lua_State *L) {
 #endif
 }
 
-int Utils::docall(lua_State *L, int narg, int clear) {
+int Utils::docall(lua_State *L, int narg, int clear, bool collect) {
   int status;
   int base = lua_gettop(L) - narg;  /* function index */
   lua_pushcfunction(L, traceback);  /* push traceback function */
   lua_insert(L, base);  /* put it under chunk and args */
   status = lua_pcall(L, narg, (clear ? 0 : LUA_MULTRET), base);
   lua_remove(L, base);  /* remove traceback function */
-  /* force a complete garbage collection in case of errors */
-  if (status != 0) lua_gc(L, LUA_GCCOLLECT, 0);
+  /* force a complete garbage collection in case of errors
+     unless the collector has been stopped (see StateMachine::setRealTimeGC()) */
+  if (status != 0 && collect) lua_gc(L, LUA_GCCOLLECT, 0);
   return status;
 }
 
 
-int Utils::dofile(lua_State *L, const char *name) {
-  int status = luaL_loadfile(L, name) || docall(L, 0, 1);
+int Utils::dofile(lua_State *L, const char *name, bool collect) {
+  int status = luaL_loadfile(L, name) || docall(L, 0, 1, collect);
   return report(L, status);
 }
 
 
-int Utils::dostring (lua_State *L, const char *s, const char *name) {
-  int status = luaL_loadbuffer(L, s, strlen(s), name) || docall(L, 0, 1);
+int Utils::dostring (lua_State *L, const char *s, const char *name, bool collect) {
+  int status = luaL_loadbuffer(L, s, strlen(s), name) || docall(L, 0, 1, collect);
+  return report(L, status);
+}
+
+
+// the buffer can hold lua source or bytecode
+int Utils::dobuffer (lua_State *L, const char *buff, size_t size, const char *name, bool collect) {
+  int status = luaL_loadbuffer(L, buff, size, name) || docall(L, 0, 1, collect);
   return report(L, status);
 }
 
@@ -85,6 +95,17 @@ int Utils::dolibrary (lua_State *L, const char *name) {
   return report(L, lua_pcall(L, 1, 0, 0));
 }
 
+int Utils::cpcall(lua_State *L, lua_CFunction func, void *ud) {
+#if LUA_VERSION_NUM == 501
+  /* lua_pushcfunction() creates a closure in lua 5.1 */
+  return lua_cpcall(L, func, ud);
+#else
+  lua_pushcfunction(L, func);
+  lua_pushlightuserdata(L, ud);
+  return lua_pcall(L, 1, 0, 0);
+#endif
+}
+
 bool Utils::isNilTableField(lua_State *L, const char *key) {
     lua_pushstring(L, key);
     lua_gettable(L, -2);
@@ -120,6 +141,19 @@ std::string Utils::getTableStringField(lua_State *L, const char *key) {
     return result;
 }
 
-void Utils::setLuaTraceCallback(LuaTraceCallback* callback) {
-     Utils::traceCallback = callback;
+void Utils::setLuaTraceCallback(lua_State *L, LuaTraceCallback* callback) {
+    lua_pushlightuserdata(L, (void*) &traceCallbackKey);
+    if(callback)
+        lua_pushlightuserdata(L, callback);
+    else
+        lua_pushnil(L);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+}
+
+LuaTraceCallback* Utils::getLuaTraceCallback(lua_State *L) {
+    lua_pushlightuserdata(L, (void*) &traceCallbackKey);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    LuaTraceCallback* callback = static_cast<LuaTraceCallback*>(lua_touserdata(L, -1));
+    lua_pop(L, 1);
+    return callback;
 }
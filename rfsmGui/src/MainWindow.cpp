@@ -7,6 +7,7 @@
 #include <fstream>
 #include <iostream>
 #include <algorithm>
+#include <limits>
 
 #include "MainWindow.h"
 #include "moc_MainWindow.cpp"
@@ -72,11 +73,15 @@ void MyStateMachine::execute() {
         thread->quit();
         return;
     }
-    mutex.lock();    
+    mutex.lock();
+    // a busy state machine must not hold the thread longer than a period
+    rfsm::StepResult result;
+    runFor(std::numeric_limits<unsigned int>::max(),
+           std::chrono::milliseconds(runPeriod), result);
     std::vector<std::string> equeue;
-    getEventQueue(equeue);
+    if(result.queueDepth)
+        getEventQueue(equeue);
     emit updateEventQueue(equeue);
-    run();
     mutex.unlock();
 }
 
@@ -112,8 +117,9 @@ void MyStateMachine::close() {
 
 
 void MyStateMachine::onPostStep() {
-    emit postStep(stateName, getCurrentState());
-    stateName = getCurrentState();
+    const std::string current = getCurrentState();
+    emit postStep(stateName, current);
+    stateName = current;
 }
 
 
@@ -434,8 +440,8 @@ bool MainWindow::loadrFSM(const std::string fname) {
     rfsm.addLuaPackagePath((path.absolutePath()+"/?.lua").toStdString());
     QDir::setCurrent(path.absolutePath());
 
-    // loading the state machine using rfsm
-    if(!rfsm.load(filename)) {
+    // loading the state machine using rfsm (the graph is drawn right away)
+    if(!rfsm.load(filename, true)) {
         QMessageBox::critical(NULL, QObject::tr("Error"), QObject::tr(string("Cannot load " + filename).c_str()));
         sourceWindow->show();
         return false;
@@ -678,6 +684,12 @@ void MainWindow::onRunPauserFSM() {
 
 
 void MainWindow::onSendEvent() {
+    // the state machine is stepped by its own thread while running
+    if(machineMode == RUN) {
+        if(!rfsm.postEvent(ui->comboBoxEvents->currentText().toStdString()))
+            showStatusBarMessage("The event queue is full!", Qt::darkRed);
+        return;
+    }
     rfsm.sendEvent(ui->comboBoxEvents->currentText().toStdString());
     std::vector<std::string> equeue;
     rfsm.getEventQueue(equeue);
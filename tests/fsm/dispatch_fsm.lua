@@ -0,0 +1,69 @@
+--
+-- Copyright (C) 2017 iCub Facility
+-- CopyPolicy: Released under the terms of the LGPLv2.1 or later, see LGPL.TXT
+--
+-- covers the cases of the transitions search: priorities, connectors,
+-- conflicts, failing guards, eventless transitions and completion events.
+-- the guards read the globals wait, go and side
+
+
+return rfsm.state {
+    ENTRY = rfsm.conn { },
+    SWITCH = rfsm.conn { },
+
+    WAIT = rfsm.state { },
+    IDLE = rfsm.state { },
+    LOW = rfsm.state { },
+    HIGH = rfsm.state { },
+    LEFT = rfsm.state { },
+    RIGHT = rfsm.state { },
+    BROKEN = rfsm.state { },
+    DONE = rfsm.state { },
+
+    GROUP = rfsm.state {
+        A = rfsm.state { },
+        B = rfsm.state { },
+
+        rfsm.transition { src='initial', tgt='A' },
+        rfsm.transition { src='A', tgt='B', events={ 'e_next' } },
+        rfsm.transition { src='B', tgt='A', events={ 'e_back' } },
+    },
+
+    -- entering through a connector
+    rfsm.transition { src='initial', tgt='ENTRY' },
+    rfsm.transition { src='ENTRY', tgt='WAIT', guard=function() return wait == true end },
+    rfsm.transition { src='ENTRY', tgt='IDLE', guard=function() return wait ~= true end },
+
+    -- eventless
+    rfsm.transition { src='WAIT', tgt='IDLE', guard=function() return go == true end },
+
+    -- priorities and conflicts
+    rfsm.transition { src='IDLE', tgt='LOW', events={ 'e_go' } },
+    rfsm.transition { src='IDLE', tgt='HIGH', events={ 'e_go' }, pn=10 },
+    rfsm.transition { src='IDLE', tgt='LEFT', events={ 'e_fork' } },
+    rfsm.transition { src='IDLE', tgt='RIGHT', events={ 'e_fork' } },
+
+    -- guarded and triggered segments of a connector
+    rfsm.transition { src='IDLE', tgt='SWITCH', events={ 'e_switch' } },
+    rfsm.transition { src='SWITCH', tgt='LEFT', guard=function() return side == 'left' end },
+    rfsm.transition { src='SWITCH', tgt='RIGHT', guard=function() return side ~= 'left' end },
+    rfsm.transition { src='SWITCH', tgt='HIGH', events={ 'e_high' } },
+
+    -- failing guard
+    rfsm.transition { src='IDLE', tgt='BROKEN', events={ 'e_broken' },
+                      guard=function() error('broken guard') end },
+
+    -- completion event of DONE
+    rfsm.transition { src='IDLE', tgt='DONE', events={ 'e_finish' } },
+    rfsm.transition { src='DONE', tgt='IDLE', events={ 'e_done' } },
+
+    -- the transitions of the outer states come first
+    rfsm.transition { src='IDLE', tgt='GROUP', events={ 'e_group' } },
+    rfsm.transition { src='GROUP', tgt='IDLE', events={ 'e_back' } },
+
+    rfsm.transition { src='LOW', tgt='IDLE', events={ 'e_back' } },
+    rfsm.transition { src='HIGH', tgt='IDLE', events={ 'e_back' } },
+    rfsm.transition { src='LEFT', tgt='IDLE', events={ 'e_back' } },
+    rfsm.transition { src='RIGHT', tgt='IDLE', events={ 'e_back' } },
+    rfsm.transition { src='BROKEN', tgt='IDLE', events={ 'e_back' } },
+}
@@ -0,0 +1,116 @@
+// -*- mode:C++ { } tab-width:4 { } c-basic-offset:4 { } indent-tabs-mode:nil -*-
+
+/*
+ * Copyright (C) 2017 iCub Facility
+ * Authors: Ali Paikan <ali.paikan@iit.it>, Nicolo' Genesio <nicolo.genesio@iit.it>
+ * CopyPolicy: Released under the terms of the LGPLv2.1 or later, see LGPL.TXT
+ */
+
+#include <rfsm.h>
+#include <rtf/TestAssert.h>
+#include <rtf/dll/Plugin.h>
+
+using namespace RTF;
+using namespace rfsm;
+
+
+/**
+ * runs the same events through the native search of the enabled
+ * transitions (fsm._find_enabled) and through the one of rfsm.lua
+ */
+class FindEnabledParity : public RTF::TestCase {
+
+public:
+    FindEnabledParity() : TestCase("FindEnabledParity") {}
+
+    virtual bool setup(int argc, char**argv) {
+        RTF_ASSERT_ERROR_IF_FALSE(argc>=2, "Missing lua rfsm file as argument");
+        filename = argv[1];
+        return true;
+    }
+
+    virtual void run() {
+
+        // entering through the default branch of the initial connector
+        load("");
+        exchange("", "IDLE");
+        exchange("e_nobit", "IDLE");
+        exchange("e_back", "IDLE");
+        exchange("e_go", "HIGH");
+        exchange("e_back", "IDLE");
+        // the order of the conflicting transitions is left to table.sort()
+        exchange("e_fork", "");
+        exchange("e_back", "IDLE");
+        exchange("e_switch", "RIGHT");
+        exchange("e_back", "IDLE");
+        RTF_TEST_CHECK(native.doString("side = 'left'") && lua.doString("side = 'left'"), "Setting side");
+        exchange("e_switch", "LEFT");
+        exchange("e_back", "IDLE");
+        exchange("e_switch e_high", "");
+        exchange("e_back", "IDLE");
+        exchange("e_broken", "IDLE");
+        exchange("e_finish", "DONE");
+        exchange("", "IDLE");
+        exchange("e_group", "GROUP.A");
+        exchange("e_next", "GROUP.B");
+        exchange("e_back", "IDLE");
+
+        // entering through the guarded branch and leaving by an eventless transition
+        load("wait = true");
+        exchange("", "WAIT");
+        exchange("e_go", "WAIT");
+        RTF_TEST_CHECK(native.doString("go = true") && lua.doString("go = true"), "Setting go");
+        exchange("", "WAIT");
+        // the transitions are searched only if there are events
+        exchange("e_nobit", "IDLE");
+    }
+
+private:
+    // loads the model in both machines, sets the globals and enters it
+    void load(const std::string& globals) {
+        RTF_ASSERT_ERROR_IF_FALSE(native.load(filename), Asserter::format("Cannot load %s", filename.c_str()));
+        RTF_ASSERT_ERROR_IF_FALSE(lua.load(filename), Asserter::format("Cannot load %s", filename.c_str()));
+        RTF_ASSERT_ERROR_IF_FALSE(native.doString("assert(fsm._find_enabled)"), "Checking the native search");
+        RTF_ASSERT_ERROR_IF_FALSE(lua.doString("fsm._find_enabled = nil"), "Removing the native search");
+        if(!globals.empty())
+            RTF_TEST_CHECK(native.doString(globals) && lua.doString(globals), "Setting " + globals);
+        RTF_TEST_CHECK(native.run() && lua.run(), "Running the state machines");
+    }
+
+    // sends the space separated events to both machines, steps them once and
+    // compares their active states (and the expected leaf, if any)
+    void exchange(const std::string& events, const std::string& expected) {
+        std::vector<std::string> queue;
+        std::string::size_type start = 0;
+        while(start < events.size()) {
+            std::string::size_type end = events.find(' ', start);
+            if(end == std::string::npos)
+                end = events.size();
+            queue.push_back(events.substr(start, end - start));
+            start = end + 1;
+        }
+        if(!queue.empty())
+            RTF_TEST_CHECK(native.sendEvents(queue) && lua.sendEvents(queue), "Sending " + events);
+        RTF_TEST_CHECK(native.step() && lua.step(), "Stepping after " + events);
+
+        std::vector<std::string> nativeStates, luaStates;
+        native.getActiveConfiguration(nativeStates);
+        lua.getActiveConfiguration(luaStates);
+        RTF_TEST_CHECK(nativeStates == luaStates,
+                       Asserter::format("Checking the active states after '%s' (got %s, expected %s)",
+                                        events.c_str(), native.getCurrentState().c_str(),
+                                        lua.getCurrentState().c_str()));
+        if(!expected.empty())
+            RTF_TEST_CHECK(lua.getCurrentState() == expected,
+                           Asserter::format("Checking the state after '%s' (got %s, expected %s)",
+                                            events.c_str(), lua.getCurrentState().c_str(),
+                                            expected.c_str()));
+    }
+
+private:
+    std::string filename;
+    rfsm::StateMachine native;
+    rfsm::StateMachine lua;
+};
+
+PREPARE_PLUGIN(FindEnabledParity)
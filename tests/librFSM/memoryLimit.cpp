@@ -0,0 +1,62 @@
+// -*- mode:C++ { } tab-width:4 { } c-basic-offset:4 { } indent-tabs-mode:nil -*-
+
+/*
+ * Copyright (C) 2017 iCub Facility
+ * Authors: Ali Paikan <ali.paikan@iit.it>, Nicolo' Genesio <nicolo.genesio@iit.it>
+ * CopyPolicy: Released under the terms of the LGPLv2.1 or later, see LGPL.TXT
+ */
+
+#include <rfsm.h>
+#include <rtf/TestAssert.h>
+#include <rtf/dll/Plugin.h>
+
+using namespace RTF;
+using namespace rfsm;
+
+
+class MemoryLimit : public RTF::TestCase {
+
+public:
+    MemoryLimit() : TestCase("MemoryLimit") {}
+
+    virtual bool setup(int argc, char**argv) {
+        RTF_ASSERT_ERROR_IF_FALSE(argc>=2, "Missing lua rfsm file as argument");
+        filename = argv[1];
+        return true;
+    }
+
+    virtual void run() {
+
+        // a limit below the footprint of the rfsm engine
+        rfsm::StateMachine small;
+        small.setMemoryLimit(64 * 1024);
+        RTF_TEST_CHECK(!small.load(filename), "Checking load() beyond the memory limit");
+        RTF_TEST_CHECK(!small.sendEvent("e_one"), "Checking sendEvent() of the unloaded state machine");
+
+        rfsm::StateMachine fsm;
+        RTF_ASSERT_ERROR_IF_FALSE(fsm.load(filename), Asserter::format("Cannot load %s", filename.c_str()));
+        RTF_TEST_CHECK(fsm.run(), "Running the state machine");
+        if(fsm.getMemoryStats().liveBytes == 0) {
+            RTF_TEST_REPORT("The memory accounting is not supported by the lua engine (skipped)");
+            return;
+        }
+
+        // the events are queued without stepping until the limit is reached
+        fsm.setMemoryLimit(fsm.getMemoryStats().liveBytes);
+        bool refused = false;
+        for(int i=0; i<100000 && !refused; i++)
+            refused = !fsm.sendEvent("e_undefined_" + std::to_string(i));
+        RTF_TEST_CHECK(refused, "Checking sendEvent() beyond the memory limit");
+        RTF_TEST_CHECK(fsm.getMemoryStats().failures > 0, "Checking the refused allocations");
+
+        // the state machine is still usable once the limit is removed
+        fsm.setMemoryLimit(0);
+        RTF_TEST_CHECK(fsm.sendEvent("e_one"), "Checking sendEvent() without the memory limit");
+        RTF_TEST_CHECK(fsm.step(), "Checking step() without the memory limit");
+    }
+
+private:
+    std::string filename;
+};
+
+PREPARE_PLUGIN(MemoryLimit)
@@ -0,0 +1,88 @@
+// -*- mode:C++ { } tab-width:4 { } c-basic-offset:4 { } indent-tabs-mode:nil -*-
+
+/*
+ * Copyright (C) 2017 iCub Facility
+ * Authors: Ali Paikan <ali.paikan@iit.it>, Nicolo' Genesio <nicolo.genesio@iit.it>
+ * CopyPolicy: Released under the terms of the LGPLv2.1 or later, see LGPL.TXT
+ */
+
+#include <rfsm.h>
+#include <rtf/TestAssert.h>
+#include <rtf/dll/Plugin.h>
+
+using namespace RTF;
+using namespace rfsm;
+
+
+/**
+ * ping-pongs the events of the model by sendAndStep(EventId). A transition
+ * allocates its path, but the event queues are reused across the steps:
+ * the allocations do not grow over time nor with the queued events
+ */
+class SteadyStateAllocations : public RTF::TestCase {
+
+public:
+    SteadyStateAllocations() : TestCase("SteadyStateAllocations"),
+        ping(InvalidEventId), pong(InvalidEventId) {}
+
+    virtual bool setup(int argc, char**argv) {
+        RTF_ASSERT_ERROR_IF_FALSE(argc>=2, "Missing lua rfsm file as argument");
+        filename = argv[1];
+        RTF_ASSERT_ERROR_IF_FALSE(fsm.load(filename), Asserter::format("Cannot load %s", filename.c_str()));
+        return true;
+    }
+
+    virtual void run() {
+
+        RTF_TEST_CHECK(fsm.run(), "Running the state machine");
+        if(fsm.getMemoryStats().liveBytes == 0) {
+            RTF_TEST_REPORT("The memory accounting is not supported by the lua engine (skipped)");
+            return;
+        }
+        ping = fsm.eventId("e_ping");
+        pong = fsm.eventId("e_pong");
+        RTF_ASSERT_ERROR_IF_FALSE(ping != InvalidEventId && pong != InvalidEventId, "Checking the event ids");
+
+        // the collector is stopped so that only the steps allocate
+        fsm.setRealTimeGC(true);
+        pingPong(100, 8);
+        unsigned long long allocations = pingPong(1000, 0);
+        RTF_TEST_REPORT(Asserter::format("%d allocations per transition", (int) (allocations / 1000)));
+        unsigned long long repeated = pingPong(1000, 0);
+        RTF_TEST_CHECK(repeated == allocations,
+                       Asserter::format("Checking the allocations of the next steps (got %d, expected %d)",
+                                        (int) repeated, (int) allocations));
+        unsigned long long queued = pingPong(1000, 8);
+        RTF_TEST_CHECK(queued == allocations,
+                       Asserter::format("Checking the allocations with queued events (got %d, expected %d)",
+                                        (int) queued, (int) allocations));
+        RTF_TEST_CHECK(fsm.getCurrentState() == "PING", "Checking the current state");
+        fsm.setRealTimeGC(false);
+    }
+
+private:
+    // takes the given transitions, each one along with extra events which
+    // trigger nothing, and returns the number of lua allocations
+    unsigned long long pingPong(unsigned int transitions, size_t extra) {
+        const std::vector<EventId> pings(extra, ping);
+        const std::vector<EventId> pongs(extra, pong);
+        bool result = true;
+        unsigned long long allocations = fsm.getMemoryStats().allocations;
+        for(unsigned int i=0; i<transitions; i++) {
+            if(extra)
+                result &= fsm.sendEvents((i % 2) ? pings : pongs);
+            result &= fsm.sendAndStep((i % 2) ? pong : ping);
+        }
+        allocations = fsm.getMemoryStats().allocations - allocations;
+        RTF_TEST_CHECK(result, "Checking the ping-pong steps");
+        return allocations;
+    }
+
+private:
+    std::string filename;
+    rfsm::StateMachine fsm;
+    EventId ping;
+    EventId pong;
+};
+
+PREPARE_PLUGIN(SteadyStateAllocations)